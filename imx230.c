@@ -25,29 +25,48 @@
 
 #include <linux/bitops.h>
 #include <linux/clk.h>
+#include <linux/completion.h>
 #include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/firmware.h>
+#include <linux/gcd.h>
 #include <linux/gpio/consumer.h>
+#include <linux/hwmon.h>
 #include <linux/i2c.h>
 #include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/nvmem-provider.h>
 #include <linux/of.h>
 #include <linux/of_graph.h>
 #include <linux/regulator/consumer.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
+#include <asm/unaligned.h>
 #include <media/v4l2-ctrls.h>
 //#include <media/v4l2-of.h>
 #include <media/v4l2-fwnode.h>
+#include <media/v4l2-rect.h>
 #include <media/v4l2-subdev.h>
 
+#ifndef MEDIA_BUS_FMT_SENSOR_DATA
+#define MEDIA_BUS_FMT_SENSOR_DATA	0x7002
+#endif
+
 static DEFINE_MUTEX(imx230_lock);
 
 #define IMX230_VOLTAGE_ANALOG               2800000
 #define IMX230_VOLTAGE_DIGITAL_CORE         1500000
 #define IMX230_VOLTAGE_DIGITAL_IO           1800000
 
+#define IMX230_XCLK_FREQ		24000000
+#define IMX230_LANES_MAX		4
+#define IMX230_LINK_FREQ_MAX		750000000
+
 #define IMX230_CHIP_ID_HIGH		0x0016
 #define		IMX230_CHIP_ID_HIGH_BYTE	0x02
 #define IMX230_CHIP_ID_LOW		0x0017
@@ -57,6 +76,175 @@ static DEFINE_MUTEX(imx230_lock);
 #define IMX230_SC_MODE_SELECT		0x0100
 #define IMX230_SC_MODE_SELECT_SW_STANDBY	0x00
 #define IMX230_SC_MODE_SELECT_STREAMING		0x01
+#define IMX230_IMAGE_ORIENTATION	0x0101
+#define		IMX230_IMAGE_ORIENTATION_HFLIP	BIT(0)
+#define		IMX230_IMAGE_ORIENTATION_VFLIP	BIT(1)
+#define IMX230_TEST_PATTERN		0x0600
+#define IMX230_TEST_PATTERN_RED		0x0602
+#define IMX230_TEST_PATTERN_GREENR	0x0604
+#define IMX230_TEST_PATTERN_BLUE	0x0606
+#define IMX230_TEST_PATTERN_GREENB	0x0608
+#define		IMX230_TEST_PATTERN_COLOUR_MAX	0x3ff
+#define IMX230_FRAME_LENGTH		0x0340
+#define		IMX230_FRAME_LENGTH_MAX		0xffff
+#define IMX230_X_ADDR_START		0x0344
+#define IMX230_CSI_DATA_FORMAT		0x0112
+#define IMX230_CSI_LANE_MODE		0x0114
+#define IMX230_EBD_SIZE_V		0xbcf1
+#define IMX230_EMBEDDED_LINES		2
+#define IMX230_STATS_OUT_EN		0x3011
+#define IMX230_STATS_LINES		2
+#define IMX230_PDAF_CTRL		0x3e37
+#define IMX230_FRAME_COUNT		0x0005
+#define IMX230_XVS_IO_CTRL		0x3040
+#define IMX230_MS_SEL			0x3041
+#define IMX230_MC_MODE			0x3f0b
+#define IMX230_EXTOUT_EN		0x4b81
+/*
+ * The sync status times up to a second of frames, at most half the frame
+ * counter wrap, every IMX230_SYNC_INTERVAL_MS. Locked within 1 /
+ * IMX230_SYNC_LOCK_TOLERANCE of the programmed period, the period error
+ * limit is in us.
+ */
+#define IMX230_SYNC_MEASURE_FRAMES	128
+#define IMX230_SYNC_INTERVAL_MS		1000
+#define IMX230_SYNC_LOCK_TOLERANCE	1000
+#define IMX230_SYNC_ERROR_MAX		1000000
+/* Frames between samples of the 8 bit frame counter, half its wrap */
+#define IMX230_FRAME_COUNT_SAMPLE	128
+/* Phase difference and confidence of a 16x12 window grid, 5 bytes each */
+#define IMX230_PDAF_WIN_H		16
+#define IMX230_PDAF_WIN_V		12
+#define IMX230_PDAF_WIN_BYTES		5
+#define IMX230_OP_PIX_CLK_DIV		0x0308
+#define IMX230_OP_PRE_DIV		0x030d
+#define		IMX230_OP_PRE_DIV_MIN		8
+#define		IMX230_OP_PRE_DIV_MAX		15
+#define IMX230_DATA_RATE		0x0820
+#define IMX230_DPHY_CTRL		0x0808
+#define		IMX230_DPHY_CTRL_AUTO		0
+/* Mode table registers that are only changed in standby */
+#define IMX230_PLL_FIRST		0x0300
+#define IMX230_PLL_LAST			0x0310
+#define IMX230_MIPI_TIMING_FIRST	0x0808
+#define IMX230_MIPI_TIMING_LAST		0x0819
+#define IMX230_SHADING_EN		0x0b00
+#define IMX230_LSC_MODE			0x3a21
+#define		IMX230_LSC_MODE_TABLE		0x02
+#define IMX230_LSC_TABLE		0x7800
+/* Shading gain grid per Bayer channel, 16 bit gains, 0x100 is unity */
+#define IMX230_LSC_GRID_H		13
+#define IMX230_LSC_GRID_V		10
+#define IMX230_LSC_GAINS		\
+	(IMX230_LSC_GRID_H * IMX230_LSC_GRID_V * 4)
+#define IMX230_LSC_GAIN_MAX		0x3ff
+#define IMX230_LSC_GAIN_UNITY		0x100
+#define IMX230_DPC_MAPPED_EN		0x0b05
+#define IMX230_DPC_SINGLE_EN		0x0b06
+#define IMX230_DPC_COUPLET_EN		0x0b08
+/* Detection thresholds of the DPC2D block, lower corrects more pixels */
+#define IMX230_DPC_THRESHOLD		0x99b0
+#define IMX230_DPC_THRESHOLD_DEF	0x20
+/* Static defect map: 16 bit x, y pairs in pixel array coordinates */
+#define IMX230_DPC_MAP_COUNT		0x7dff
+#define IMX230_DPC_MAP			0x7e00
+#define IMX230_DPC_MAP_MAX		128
+#define IMX230_DPC_MAP_END		0xffff
+#define IMX230_OTP_CTRL			0x0a00
+#define		IMX230_OTP_CTRL_READ		0x01
+#define IMX230_OTP_STATUS		0x0a01
+#define		IMX230_OTP_STATUS_READY		BIT(0)
+#define IMX230_OTP_PAGE			0x0a02
+#define IMX230_OTP_DATA			0x0a04
+#define IMX230_OTP_PAGE_SIZE		64
+#define IMX230_OTP_PAGES		16
+#define IMX230_OTP_TIMEOUT_US		10000
+#define IMX230_TEMP_SENS_CTL		0x0138
+#define IMX230_TEMP_SENS_OUT		0x013a
+/* Throttle temperature range in degrees C, and the release hysteresis */
+#define IMX230_TEMP_MAX			80
+#define IMX230_TEMP_HYSTERESIS		5
+#define IMX230_SCALING_MODE		0x0401
+#define		IMX230_SCALING_MODE_NONE	0x00
+#define		IMX230_SCALING_MODE_HV		0x02
+#define IMX230_SCALE_M			0x0404
+#define		IMX230_SCALE_M_MIN		16
+#define		IMX230_SCALE_M_MAX		255
+#define IMX230_DIG_CROP_X_OFFSET	0x0408
+
+/* Active pixel array, in the coordinates of the address registers */
+#define IMX230_NATIVE_WIDTH		5344
+#define IMX230_NATIVE_HEIGHT		4016
+/* Smallest crop window, in output pixels */
+#define IMX230_CROP_MIN			64
+
+#define IMX230_VBLANK_MIN		32
+/* Lines between the end of the exposure and the end of the frame */
+#define IMX230_EXPOSURE_MARGIN		10
+#define IMX230_GROUP_HOLD		0x0104
+#define IMX230_FAST_STANDBY_CTRL	0x0106
+#define IMX230_EXPOSURE			0x0202
+#define IMX230_HDR_MODE			0x0220
+#define		IMX230_HDR_MODE_LINEAR		0x00
+#define		IMX230_HDR_MODE_FUSED		0x03	/* combined on sensor */
+#define IMX230_HDR_RATIO		0x0222
+#define IMX230_SHORT_EXPOSURE		0x0224
+#define IMX230_ANALOG_GAIN		0x0204
+#define		IMX230_ANALOG_GAIN_MAX		480
+#define IMX230_DIGITAL_GAIN_GR		0x020e
+#define		IMX230_DIGITAL_GAIN_MIN		0x0100
+#define		IMX230_DIGITAL_GAIN_MAX		0x0fff
+
+/* V4L2_CID_GAIN is the total gain in 1/16 steps */
+#define IMX230_GAIN_MIN			16
+#define IMX230_GAIN_MAX			1023
+#define IMX230_GAIN_STEPS		(IMX230_GAIN_MAX - IMX230_GAIN_MIN + 1)
+
+/*
+ * Frames between the frame in which a control is written and the first
+ * frame it affects. Exposure, gain and frame length are written under
+ * group hold and latched together, the flips apply to the next readout.
+ */
+#define IMX230_EXPOSURE_DELAY		2
+#define IMX230_GAIN_DELAY		2
+#define IMX230_FRAME_LENGTH_DELAY	2
+#define IMX230_FLIP_DELAY		1
+
+/* Driver private controls */
+#define IMX230_CID_BASE			(V4L2_CID_USER_BASE | 0x1f00)
+#define IMX230_CID_EXPOSURE_DELAY	(IMX230_CID_BASE + 0)
+#define IMX230_CID_GAIN_DELAY		(IMX230_CID_BASE + 1)
+#define IMX230_CID_FRAME_LENGTH_DELAY	(IMX230_CID_BASE + 2)
+#define IMX230_CID_FLIP_DELAY		(IMX230_CID_BASE + 3)
+#define IMX230_CID_GROUP_HOLD		(IMX230_CID_BASE + 4)
+#define IMX230_CID_STATS		(IMX230_CID_BASE + 5)
+#define IMX230_CID_SYNC_LOCKED		(IMX230_CID_BASE + 6)
+#define IMX230_CID_SYNC_PERIOD_ERROR	(IMX230_CID_BASE + 7)
+#define IMX230_CID_TRIGGER_MODE		(IMX230_CID_BASE + 8)
+#define IMX230_CID_TRIGGER		(IMX230_CID_BASE + 9)
+#define IMX230_CID_TRIGGER_BURST	(IMX230_CID_BASE + 10)
+#define IMX230_CID_FRAMES_LOST		(IMX230_CID_BASE + 11)
+#define IMX230_CID_HDR_RATIO		(IMX230_CID_BASE + 12)
+#define IMX230_CID_LSC_TABLE		(IMX230_CID_BASE + 13)
+#define IMX230_CID_DPC_MODE		(IMX230_CID_BASE + 14)
+#define IMX230_CID_DPC_THRESHOLD	(IMX230_CID_BASE + 15)
+#define IMX230_CID_DEFECT_MAP		(IMX230_CID_BASE + 16)
+#define IMX230_CID_TEMP_INTERVAL	(IMX230_CID_BASE + 17)
+#define IMX230_CID_TEMP_THROTTLE	(IMX230_CID_BASE + 18)
+#define IMX230_CID_SENSOR_FRAMES	(IMX230_CID_BASE + 19)
+#define IMX230_CID_DELIVERED_FRAMES	(IMX230_CID_BASE + 20)
+#define IMX230_CID_DROPPED_FRAMES	(IMX230_CID_BASE + 21)
+
+#define IMX230_TRIGGER_BURST_MAX	255
+
+/* IMX230_CID_GROUP_HOLD bits: controls written under group hold */
+#define IMX230_GROUP_HOLD_EXPOSURE	BIT(0)
+#define IMX230_GROUP_HOLD_GAIN		BIT(1)
+#define IMX230_GROUP_HOLD_FRAME_LENGTH	BIT(2)
+#define IMX230_GROUP_HOLD_FLIP		BIT(3)
+
+/* Longest run of consecutive registers sent in one i2c message */
+#define IMX230_BURST_MAX		64
 
 struct reg_value {
 	u16 reg;
@@ -68,11 +256,92 @@ struct imx230_mode_info {
 	u32 height;
 	const struct reg_value *data;
 	u32 data_size;
-	u32 pixel_clock;
-	u32 link_freq;
 	u16 exposure_max;
 	u16 exposure_def;
-	struct v4l2_fract timeperframe;
+	u32 pixel_rate;		/* of the VT PLL set by the mode table */
+	u16 line_length;
+	u16 frame_length;
+	struct v4l2_rect crop;	/* in native pixel array coordinates */
+	u32 binning;		/* crop size / output size */
+	u8 hdr_mode;		/* IMX230_HDR_MODE with HDR on, 0 if none */
+	struct v4l2_fract timeperframe;	/* rounded, for enumeration */
+};
+
+/*
+ * Controls backed by sensor registers. A set bit in imx230->ctrls_dirty
+ * means the control value has not been written to the sensor since the
+ * last power-up (or since a mode table overwrote its registers).
+ */
+enum imx230_hw_ctrl {
+	IMX230_CTRL_EXPOSURE,
+	IMX230_CTRL_ANALOG_GAIN,
+	IMX230_CTRL_DIGITAL_GAIN,
+	IMX230_CTRL_ORIENTATION,
+	IMX230_CTRL_FRAME_LENGTH,
+	IMX230_CTRL_HDR,
+	IMX230_CTRL_DPC_MODE,
+	IMX230_CTRL_DPC_THRESHOLD,
+	IMX230_CTRL_TEST_PATTERN,
+	IMX230_CTRL_TEST_PATTERN_RED,
+	IMX230_CTRL_TEST_PATTERN_GREENR,
+	IMX230_CTRL_TEST_PATTERN_BLUE,
+	IMX230_CTRL_TEST_PATTERN_GREENB,
+	IMX230_CTRL_NUM,
+};
+
+#define IMX230_CTRLS_ALL	(BIT(IMX230_CTRL_NUM) - 1)
+/* Controls whose registers are also written by the mode tables */
+#define IMX230_CTRLS_IN_MODE	(BIT(IMX230_CTRL_EXPOSURE) | \
+				 BIT(IMX230_CTRL_ANALOG_GAIN) | \
+				 BIT(IMX230_CTRL_DIGITAL_GAIN) | \
+				 BIT(IMX230_CTRL_FRAME_LENGTH) | \
+				 BIT(IMX230_CTRL_HDR))
+
+#define IMX230_NUM_FORMATS		3
+
+/* Frame synchronisation, from the sony,sync-mode firmware property */
+enum imx230_sync_mode {
+	IMX230_SYNC_NONE,
+	IMX230_SYNC_MASTER,	/* drives XVS */
+	IMX230_SYNC_SLAVE,	/* starts frames on the XVS input */
+};
+
+enum imx230_dpc_mode {
+	IMX230_DPC_OFF,
+	IMX230_DPC_SINGLE,
+	IMX230_DPC_COUPLET,
+	IMX230_DPC_STATIC,
+	IMX230_DPC_STATIC_DYNAMIC,
+};
+
+enum imx230_pad {
+	IMX230_PAD_IMAGE,
+	IMX230_PAD_META,	/* embedded data lines */
+	IMX230_PAD_PDAF,	/* phase detection AF data */
+	IMX230_NUM_PADS,
+};
+
+struct imx230_format {
+	u32 codes[4];
+	u8 bpp;
+	u16 data_format;	/* IMX230_CSI_DATA_FORMAT: source, output bpp */
+};
+
+/*
+ * What a mode can do on this board, computed at probe once the lanes and
+ * link frequencies are known.
+ */
+struct imx230_mode_caps {
+	s8 link_freq_idx[IMX230_NUM_FORMATS];	/* -1 if the link is too slow */
+	u32 readout_cost;	/* pixels read out per frame */
+	u32 min_width;		/* smallest scaled output */
+	u32 min_height;
+};
+
+/* Split of one V4L2_CID_GAIN step into the sensor gain registers */
+struct imx230_gain_step {
+	u16 analog;	/* analog gain code, gain = 512 / (512 - code) */
+	u16 digital;	/* digital gain, 0x100 = 1x */
 };
 /*
 struct imx230_ctrls {
@@ -101,8 +370,18 @@ struct imx230 {
 	struct i2c_client *i2c_client;
 	struct device *dev;
 	struct v4l2_subdev sd;
-	struct media_pad pad;
+	struct media_pad pads[IMX230_NUM_PADS];
+	/* Set while the links of the metadata and PDAF pads are enabled */
+	bool embedded_data;
+	bool pdaf;
+	enum imx230_sync_mode sync_mode;
 	struct v4l2_fwnode_endpoint ep;
+	unsigned int lanes;
+	/* Link frequencies allowed by the endpoint, in the LINK_FREQ menu */
+	const s64 *link_freqs;
+	unsigned int nr_link_freqs;
+	/* Indexed like imx230_mode_info_data */
+	struct imx230_mode_caps *mode_caps;
 	struct v4l2_mbus_framefmt fmt;
 	struct v4l2_rect crop;
 	struct clk *xclk;
@@ -112,12 +391,59 @@ struct imx230 {
 	struct regulator *analog_regulator;
 
 	const struct imx230_mode_info *current_mode;
+	const struct imx230_format *current_format;
+	/* Mode held by the sensor registers, NULL after power-up */
+	const struct imx230_mode_info *programmed_mode;
+	/* Crop window or output size changed since the mode was programmed */
+	bool readout_dirty;
+	/* Registers to write to switch from staged_from to staged_to */
+	struct reg_value *staged_regs;
+	unsigned int staged_size;
+	const struct imx230_mode_info *staged_from;
+	const struct imx230_mode_info *staged_to;
+	bool staged_standby;
+	/* Nesting depth of the group hold */
+	unsigned int hold_count;
+	/* Shading table as written to the sensor, lost on power off */
+	u8 lsc_table[IMX230_LSC_GAINS * 2];
+	bool lsc_loaded;
+	bool lsc_dirty;
+	struct v4l2_ctrl *lsc;
+	/* Completed once the shading table file has been handled */
+	struct completion lsc_done;
+	/* Static defect map as written to the sensor, lost on power off */
+	u8 dpc_map[IMX230_DPC_MAP_MAX * 4];
+	unsigned int dpc_count;
+	bool dpc_dirty;
+	struct v4l2_ctrl *defect_map;
+	/* Completed once the defect map file has been handled */
+	struct completion dpc_done;
+	/* OTP contents, read once at probe */
+	u8 otp[IMX230_OTP_PAGES * IMX230_OTP_PAGE_SIZE];
+	struct nvmem_device *otp_nvmem;
+	/* Scaler ratio, the output is 16 / scale_m of the digital crop */
+	u32 scale_m;
+	/* Requested frame interval, zero numerator for the mode default */
+	struct v4l2_fract frame_interval;
 
 	struct v4l2_ctrl_handler ctrls;
 	struct v4l2_ctrl *pixel_clock;
 	struct v4l2_ctrl *link_freq;
 	struct v4l2_ctrl *exposure;
+	struct v4l2_ctrl *vblank;
 	struct v4l2_ctrl *gain;
+	struct v4l2_ctrl *analog_gain;
+	struct v4l2_ctrl *digital_gain;
+	struct v4l2_ctrl *hflip;
+	struct v4l2_ctrl *vflip;
+	/* Cluster, read together */
+	struct v4l2_ctrl *sync_locked;
+	struct v4l2_ctrl *sync_error;
+	struct v4l2_ctrl *stats;
+	struct v4l2_ctrl *test_pattern;
+	struct v4l2_ctrl *hw_ctrls[IMX230_CTRL_NUM];
+	unsigned long ctrls_dirty; /* protected by the control handler lock */
+	struct imx230_gain_step gain_lut[IMX230_GAIN_STEPS];
 
 //	struct imx230_ctrls imx230_ctrls;
 
@@ -132,9 +458,49 @@ struct imx230 {
 	struct mutex power_lock; /* lock to protect power state */
 //	int power_count;
 	bool power_on;
+	bool streaming;
 
 	struct gpio_desc *enable_gpio;
 	struct gpio_desc *rst_gpio;
+
+	/* Triggered capture: armed in standby while streaming is on */
+	struct v4l2_ctrl *trigger_mode;
+	struct v4l2_ctrl *trigger_burst;
+	struct v4l2_ctrl *frames_lost;
+	struct v4l2_ctrl *wdr;
+	struct v4l2_ctrl *hdr_ratio;
+	struct gpio_desc *trigger_gpio;
+	int trigger_irq;
+	struct delayed_work trigger_work;
+	bool burst_active;
+	u8 burst_start;		/* frame counter before the burst */
+	u8 burst_frames;
+	ktime_t burst_timeout;
+
+	/* Temperature sampled while streaming, in millidegrees C */
+	struct v4l2_ctrl *temp_interval;
+	struct v4l2_ctrl *temp_throttle;
+	struct delayed_work temp_work;
+	int temperature;
+	bool temp_valid;
+	/* Frame rate halved above the throttle temperature */
+	bool throttled;
+	s32 throttle_vblank;		/* VBLANK before throttling */
+	s32 throttled_vblank;		/* VBLANK set by the throttle */
+	struct device *hwmon;
+
+	/* Last frame period measured by sync_work, 0 if frames stopped */
+	struct delayed_work sync_work;
+	u64 sync_period;
+	u64 sync_expected;
+
+	/* Sensor frames since stream start, extended from the 8 bit counter */
+	u64 frame_count;
+	u8 frame_count_last;
+	struct delayed_work frame_work;
+	struct v4l2_ctrl *delivered_frames;
+	/* Sensor frames when Delivered Frames was last set */
+	u64 delivered_at;
 };
 
 static inline struct imx230 *to_imx230(struct v4l2_subdev *sd)
@@ -1003,456 +1369,3366 @@ static const struct reg_value imx230_setting_720[] = {
   {0x0819, 0x4F},
 };
 
-static const s64 link_freq[] = {
-	240000000,
-	240000000,
-};
-
-static const struct imx230_mode_info imx230_mode_info_data[] = {
-	{
-		.width = 5344,
-		.height = 4016,
-		.data = imx230_setting_full,
-		.data_size = ARRAY_SIZE(imx230_setting_full),
-		.pixel_clock = 568000000,
-		.link_freq = 0, /* an index in link_freq[] */
-		.exposure_max = 1704,
-		.exposure_def = 504,
-		.timeperframe = {
-			.numerator = 100,
-			.denominator = 2400,
-		}
-	},
-        {
-                .width = 4272,
-                .height = 2404,
-                .data = imx230_setting_4k2k,
-                .data_size = ARRAY_SIZE(imx230_setting_4k2k),
-                .pixel_clock = 459520000,
-                .link_freq = 0, /* an index in link_freq[] */
-                .exposure_max = 1704,
-                .exposure_def = 504,
-                .timeperframe = {
-                        .numerator = 100,
-                        .denominator = 2400,
-                }
-        },
-	{
-		.width = 2136,
-		.height = 1202,
-		.data = imx230_setting_1080,
-		.data_size = ARRAY_SIZE(imx230_setting_1080),
-		.pixel_clock = 459520000,
-		.link_freq = 0, /* an index in link_freq[] */
-		.exposure_max = 840,
-		.exposure_def = 504,
-		.timeperframe = {
-			.numerator = 30,
-			.denominator = 1000,
-		}
-	},
-        {
-                .width = 1316,
-                .height = 740,
-                .data = imx230_setting_720,
-                .data_size = ARRAY_SIZE(imx230_setting_720),
-                .pixel_clock = 459520000,
-                .link_freq = 0, /* an index in link_freq[] */
-                .exposure_max = 840,
-                .exposure_def = 504,
-                .timeperframe = {
-                        .numerator = 100,
-                        .denominator = 12000,
-                }
-        },
-#if 0
-	{
-		.width = 640,
-		.height = 480,
-		.data = imx230_global_init_setting,//imx230_setting_vga_90fps,
-		.data_size = ARRAY_SIZE(imx230_global_init_setting),//ARRAY_SIZE(imx230_setting_vga_90fps),
-		.pixel_clock = 48000000,
-		.link_freq = 0, /* an index in link_freq[] */
-		.exposure_max = 552,
-		.exposure_def = 504,
-		.timeperframe = {
-			.numerator = 100,
-			.denominator = 9043
-		}
-	},
-#endif
+static const struct reg_value imx230_setting_bin2[] = {
+  /* Mode: 2672x2008 2x2 binned full FOV 30 fps */
+  /* Preset Settings */
+  {0x9004, 0x00},
+  {0x9005, 0x00},
+  /* Mode Settings */
+  {0x0114, 0x03},
+  {0x0220, 0x00},
+  {0x0221, 0x11},
+  {0x0222, 0x01},
+  {0x0340, 0x0C},
+  {0x0341, 0xF8},
+  {0x0342, 0x17},
+  {0x0343, 0x88},
+  {0x0344, 0x00},
+  {0x0345, 0x00},
+  {0x0346, 0x00},
+  {0x0347, 0x00},
+  {0x0348, 0x14},
+  {0x0349, 0xDF},
+  {0x034A, 0x0F},
+  {0x034B, 0xAF},
+  {0x0381, 0x01},
+  {0x0383, 0x01},
+  {0x0385, 0x01},
+  {0x0387, 0x01},
+  {0x0900, 0x01},
+  {0x0901, 0x22},
+  {0x0902, 0x00},
+  {0x3000, 0x74},
+  {0x3001, 0x00},
+  {0x305C, 0x11},
+  /* Output Size Settings */
+  {0x0112, 0x0A},
+  {0x0113, 0x0A},
+  {0x034C, 0x0A},
+  {0x034D, 0x70},
+  {0x034E, 0x07},
+  {0x034F, 0xD8},
+  {0x0401, 0x00},
+  {0x0404, 0x00},
+  {0x0405, 0x10},
+  {0x0408, 0x00},
+  {0x0409, 0x00},
+  {0x040A, 0x00},
+  {0x040B, 0x00},
+  {0x040C, 0x0A},
+  {0x040D, 0x70},
+  {0x040E, 0x07},
+  {0x040F, 0xD8},
+  /* Clock Settings */
+  {0x0301, 0x04},
+  {0x0303, 0x02},
+  {0x0305, 0x04},
+  {0x0306, 0x00},
+  {0x0307, 0xC8},
+  {0x0309, 0x0A},
+  {0x030B, 0x01},
+  {0x030D, 0x0F},
+  {0x030E, 0x02},
+  {0x030F, 0xCE},
+  {0x0310, 0x01},
+  /* Data Rate Settings */
+  {0x0820, 0x11},
+  {0x0821, 0xF3},
+  {0x0822, 0x33},
+  {0x0823, 0x33},
+  /* Integration Time Settings */
+  {0x0202, 0x0C},
+  {0x0203, 0xEE},
+  {0x0224, 0x01},
+  {0x0225, 0xF4},
+  /* Gain Setting */
+  {0x0204, 0x00},
+  {0x0205, 0x00},
+  {0x0216, 0x00},
+  {0x0217, 0x00},
+  {0x020E, 0x01},
+  {0x020F, 0x00},
+  {0x0210, 0x01},
+  {0x0211, 0x00},
+  {0x0212, 0x01},
+  {0x0213, 0x00},
+  {0x0214, 0x01},
+  {0x0215, 0x00},
+  /* HDR Settings */
+  {0x3006, 0x01},
+  {0x3007, 0x02},
+  {0x31E0, 0x03},
+  {0x31E1, 0xFF},
+  {0x31E4, 0x02},
+  /* DPC2D Settings */
+  {0x3A22, 0x20},
+  {0x3A23, 0x14},
+  {0x3A24, 0xE0},
+  {0x3A25, 0x07},
+  {0x3A26, 0xD8},
+  {0x3A2F, 0x00},
+  {0x3A30, 0x00},
+  {0x3A31, 0x00},
+  {0x3A32, 0x00},
+  {0x3A33, 0x14},
+  {0x3A34, 0xDF},
+  {0x3A35, 0x0F},
+  {0x3A36, 0xAF},
+  {0x3A37, 0x00},
+  {0x3A38, 0x01},
+  {0x3A39, 0x00},
+  /* LSC Settings */
+  {0x3A21, 0x00},
+  /* Stats Setting */
+  {0x3011, 0x00},
+  {0x3013, 0x00},
+  /* MIPI Global Timing Settings*/
+  {0x080A, 0x00},
+  {0x080B, 0xA7},
+  {0x080C, 0x00},
+  {0x080D, 0x6F},
+  {0x080E, 0x00},
+  {0x080F, 0x9F},
+  {0x0810, 0x00},
+  {0x0811, 0x5F},
+  {0x0812, 0x00},
+  {0x0813, 0x5F},
+  {0x0814, 0x00},
+  {0x0815, 0x6F},
+  {0x0816, 0x01},
+  {0x0817, 0x7F},
+  {0x0818, 0x00},
+  {0x0819, 0x4F},
 };
 
-static int imx230_read_reg(struct imx230 *imx230, u16 reg, u8 *val)
-{
-	u8 regbuf[2];
-	int ret;
-
-	regbuf[0] = reg >> 8;
-	regbuf[1] = reg & 0xff;
-
-	ret = i2c_master_send(imx230->i2c_client, regbuf, 2);
-	if (ret < 0) {
-		dev_err(imx230->dev, "%s: write reg error %d: reg=%x\n",
-			__func__, ret, reg);
-		return ret;
-	}
-
-	ret = i2c_master_recv(imx230->i2c_client, val, 1);
-	if (ret < 0) {
-		dev_err(imx230->dev, "%s: read reg error %d: reg=%x\n",
-			__func__, ret, reg);
-		return ret;
-	}
-
-	return 0;
-}
-
-static int imx230_write_reg(struct imx230 *imx230, u16 reg, u8 val)
-{
-	u8 regbuf[3];
-	int ret;
-
-	regbuf[0] = reg >> 8;
-	regbuf[1] = reg & 0xff;
-	regbuf[2] = val;
-
-	ret = i2c_master_send(imx230->i2c_client, regbuf, 3);
-	if (ret < 0) {
-		dev_err(imx230->dev, "%s: write reg error %d: reg=%x, val=%x\n",
-			__func__, ret, reg, val);
-		return ret;
-	}
-
-	return 0;
-}
-
-static int imx230_regulators_enable(struct imx230 *imx230)
-{
-	int ret;
-
-	ret = regulator_enable(imx230->io_regulator);
-	if (ret < 0) {
-		dev_err(imx230->dev, "set io voltage failed\n");
-		return ret;
-	}
-
-	ret = regulator_enable(imx230->analog_regulator);
-	if (ret) {
-		dev_err(imx230->dev, "set analog voltage failed\n");
-		goto err_disable_io;
-	}
-
-	ret = regulator_enable(imx230->core_regulator);
-	if (ret) {
+static const struct reg_value imx230_setting_bin4[] = {
+  /* Mode: 1336x1004 2x2 binned + 2x subsampled full FOV 60 fps */
+  /* Preset Settings */
+  {0x9004, 0x00},
+  {0x9005, 0x00},
+  /* Mode Settings */
+  {0x0114, 0x03},
+  {0x0220, 0x00},
+  {0x0221, 0x11},
+  {0x0222, 0x01},
+  {0x0340, 0x06},
+  {0x0341, 0x7C},
+  {0x0342, 0x17},
+  {0x0343, 0x88},
+  {0x0344, 0x00},
+  {0x0345, 0x00},
+  {0x0346, 0x00},
+  {0x0347, 0x00},
+  {0x0348, 0x14},
+  {0x0349, 0xDF},
+  {0x034A, 0x0F},
+  {0x034B, 0xAF},
+  {0x0381, 0x01},
+  {0x0383, 0x03},
+  {0x0385, 0x01},
+  {0x0387, 0x03},
+  {0x0900, 0x01},
+  {0x0901, 0x22},
+  {0x0902, 0x00},
+  {0x3000, 0x74},
+  {0x3001, 0x00},
+  {0x305C, 0x11},
+  /* Output Size Settings */
+  {0x0112, 0x0A},
+  {0x0113, 0x0A},
+  {0x034C, 0x05},
+  {0x034D, 0x38},
+  {0x034E, 0x03},
+  {0x034F, 0xEC},
+  {0x0401, 0x00},
+  {0x0404, 0x00},
+  {0x0405, 0x10},
+  {0x0408, 0x00},
+  {0x0409, 0x00},
+  {0x040A, 0x00},
+  {0x040B, 0x00},
+  {0x040C, 0x05},
+  {0x040D, 0x38},
+  {0x040E, 0x03},
+  {0x040F, 0xEC},
+  /* Clock Settings */
+  {0x0301, 0x04},
+  {0x0303, 0x02},
+  {0x0305, 0x04},
+  {0x0306, 0x00},
+  {0x0307, 0xC8},
+  {0x0309, 0x0A},
+  {0x030B, 0x01},
+  {0x030D, 0x0F},
+  {0x030E, 0x02},
+  {0x030F, 0xCE},
+  {0x0310, 0x01},
+  /* Data Rate Settings */
+  {0x0820, 0x11},
+  {0x0821, 0xF3},
+  {0x0822, 0x33},
+  {0x0823, 0x33},
+  /* Integration Time Settings */
+  {0x0202, 0x06},
+  {0x0203, 0x72},
+  {0x0224, 0x01},
+  {0x0225, 0xF4},
+  /* Gain Setting */
+  {0x0204, 0x00},
+  {0x0205, 0x00},
+  {0x0216, 0x00},
+  {0x0217, 0x00},
+  {0x020E, 0x01},
+  {0x020F, 0x00},
+  {0x0210, 0x01},
+  {0x0211, 0x00},
+  {0x0212, 0x01},
+  {0x0213, 0x00},
+  {0x0214, 0x01},
+  {0x0215, 0x00},
+  /* HDR Settings */
+  {0x3006, 0x01},
+  {0x3007, 0x02},
+  {0x31E0, 0x03},
+  {0x31E1, 0xFF},
+  {0x31E4, 0x02},
+  /* DPC2D Settings */
+  {0x3A22, 0x20},
+  {0x3A23, 0x14},
+  {0x3A24, 0xE0},
+  {0x3A25, 0x03},
+  {0x3A26, 0xEC},
+  {0x3A2F, 0x00},
+  {0x3A30, 0x00},
+  {0x3A31, 0x00},
+  {0x3A32, 0x00},
+  {0x3A33, 0x14},
+  {0x3A34, 0xDF},
+  {0x3A35, 0x0F},
+  {0x3A36, 0xAF},
+  {0x3A37, 0x00},
+  {0x3A38, 0x01},
+  {0x3A39, 0x00},
+  /* LSC Settings */
+  {0x3A21, 0x00},
+  /* Stats Setting */
+  {0x3011, 0x00},
+  {0x3013, 0x00},
+  /* MIPI Global Timing Settings*/
+  {0x080A, 0x00},
+  {0x080B, 0xA7},
+  {0x080C, 0x00},
+  {0x080D, 0x6F},
+  {0x080E, 0x00},
+  {0x080F, 0x9F},
+  {0x0810, 0x00},
+  {0x0811, 0x5F},
+  {0x0812, 0x00},
+  {0x0813, 0x5F},
+  {0x0814, 0x00},
+  {0x0815, 0x6F},
+  {0x0816, 0x01},
+  {0x0817, 0x7F},
+  {0x0818, 0x00},
+  {0x0819, 0x4F},
+};
+
+static const struct reg_value imx230_setting_720_240fps[] = {
+  /* Mode: 1280x720 2x2 binned crop 240 fps */
+  /* Preset Settings */
+  {0x9004, 0x00},
+  {0x9005, 0x00},
+  /* Mode Settings */
+  {0x0114, 0x03},
+  {0x0220, 0x00},
+  {0x0221, 0x11},
+  {0x0222, 0x01},
+  {0x0340, 0x03},
+  {0x0341, 0x7C},
+  {0x0342, 0x0A},
+  {0x0343, 0xF0},
+  {0x0344, 0x05},
+  {0x0345, 0x70},
+  {0x0346, 0x05},
+  {0x0347, 0x08},
+  {0x0348, 0x0F},
+  {0x0349, 0x6F},
+  {0x034A, 0x0A},
+  {0x034B, 0xA7},
+  {0x0381, 0x01},
+  {0x0383, 0x01},
+  {0x0385, 0x01},
+  {0x0387, 0x01},
+  {0x0900, 0x01},
+  {0x0901, 0x22},
+  {0x0902, 0x00},
+  {0x3000, 0x74},
+  {0x3001, 0x00},
+  {0x305C, 0x11},
+  /* Output Size Settings */
+  {0x0112, 0x0A},
+  {0x0113, 0x0A},
+  {0x034C, 0x05},
+  {0x034D, 0x00},
+  {0x034E, 0x02},
+  {0x034F, 0xD0},
+  {0x0401, 0x00},
+  {0x0404, 0x00},
+  {0x0405, 0x10},
+  {0x0408, 0x00},
+  {0x0409, 0x00},
+  {0x040A, 0x00},
+  {0x040B, 0x00},
+  {0x040C, 0x05},
+  {0x040D, 0x00},
+  {0x040E, 0x02},
+  {0x040F, 0xD0},
+  /* Clock Settings */
+  {0x0301, 0x04},
+  {0x0303, 0x02},
+  {0x0305, 0x04},
+  {0x0306, 0x00},
+  {0x0307, 0xC8},
+  {0x0309, 0x0A},
+  {0x030B, 0x01},
+  {0x030D, 0x0F},
+  {0x030E, 0x02},
+  {0x030F, 0xCE},
+  {0x0310, 0x01},
+  /* Data Rate Settings */
+  {0x0820, 0x11},
+  {0x0821, 0xF3},
+  {0x0822, 0x33},
+  {0x0823, 0x33},
+  /* Integration Time Settings */
+  {0x0202, 0x01},
+  {0x0203, 0xF8},
+  {0x0224, 0x01},
+  {0x0225, 0xF4},
+  /* Gain Setting */
+  {0x0204, 0x00},
+  {0x0205, 0x00},
+  {0x0216, 0x00},
+  {0x0217, 0x00},
+  {0x020E, 0x01},
+  {0x020F, 0x00},
+  {0x0210, 0x01},
+  {0x0211, 0x00},
+  {0x0212, 0x01},
+  {0x0213, 0x00},
+  {0x0214, 0x01},
+  {0x0215, 0x00},
+  /* HDR Settings */
+  {0x3006, 0x01},
+  {0x3007, 0x02},
+  {0x31E0, 0x03},
+  {0x31E1, 0xFF},
+  {0x31E4, 0x02},
+  /* DPC2D Settings */
+  {0x3A22, 0x20},
+  {0x3A23, 0x14},
+  {0x3A24, 0xE0},
+  {0x3A25, 0x02},
+  {0x3A26, 0xD0},
+  {0x3A2F, 0x05},
+  {0x3A30, 0x70},
+  {0x3A31, 0x05},
+  {0x3A32, 0x08},
+  {0x3A33, 0x0F},
+  {0x3A34, 0x6F},
+  {0x3A35, 0x0A},
+  {0x3A36, 0xA7},
+  {0x3A37, 0x00},
+  {0x3A38, 0x01},
+  {0x3A39, 0x00},
+  /* LSC Settings */
+  {0x3A21, 0x00},
+  /* Stats Setting */
+  {0x3011, 0x00},
+  {0x3013, 0x00},
+  /* MIPI Global Timing Settings*/
+  {0x080A, 0x00},
+  {0x080B, 0xA7},
+  {0x080C, 0x00},
+  {0x080D, 0x6F},
+  {0x080E, 0x00},
+  {0x080F, 0x9F},
+  {0x0810, 0x00},
+  {0x0811, 0x5F},
+  {0x0812, 0x00},
+  {0x0813, 0x5F},
+  {0x0814, 0x00},
+  {0x0815, 0x6F},
+  {0x0816, 0x01},
+  {0x0817, 0x7F},
+  {0x0818, 0x00},
+  {0x0819, 0x4F},
+};
+
+static const struct reg_value imx230_setting_vga_360fps[] = {
+  /* Mode: 640x480 2x2 binned + 2x subsampled crop 360 fps */
+  /* Preset Settings */
+  {0x9004, 0x00},
+  {0x9005, 0x00},
+  /* Mode Settings */
+  {0x0114, 0x03},
+  {0x0220, 0x00},
+  {0x0221, 0x11},
+  {0x0222, 0x01},
+  {0x0340, 0x02},
+  {0x0341, 0x53},
+  {0x0342, 0x0A},
+  {0x0343, 0xF0},
+  {0x0344, 0x05},
+  {0x0345, 0x70},
+  {0x0346, 0x04},
+  {0x0347, 0x18},
+  {0x0348, 0x0F},
+  {0x0349, 0x6F},
+  {0x034A, 0x0B},
+  {0x034B, 0x97},
+  {0x0381, 0x01},
+  {0x0383, 0x03},
+  {0x0385, 0x01},
+  {0x0387, 0x03},
+  {0x0900, 0x01},
+  {0x0901, 0x22},
+  {0x0902, 0x00},
+  {0x3000, 0x74},
+  {0x3001, 0x00},
+  {0x305C, 0x11},
+  /* Output Size Settings */
+  {0x0112, 0x0A},
+  {0x0113, 0x0A},
+  {0x034C, 0x02},
+  {0x034D, 0x80},
+  {0x034E, 0x01},
+  {0x034F, 0xE0},
+  {0x0401, 0x00},
+  {0x0404, 0x00},
+  {0x0405, 0x10},
+  {0x0408, 0x00},
+  {0x0409, 0x00},
+  {0x040A, 0x00},
+  {0x040B, 0x00},
+  {0x040C, 0x02},
+  {0x040D, 0x80},
+  {0x040E, 0x01},
+  {0x040F, 0xE0},
+  /* Clock Settings */
+  {0x0301, 0x04},
+  {0x0303, 0x02},
+  {0x0305, 0x04},
+  {0x0306, 0x00},
+  {0x0307, 0xC8},
+  {0x0309, 0x0A},
+  {0x030B, 0x01},
+  {0x030D, 0x0F},
+  {0x030E, 0x02},
+  {0x030F, 0xCE},
+  {0x0310, 0x01},
+  /* Data Rate Settings */
+  {0x0820, 0x11},
+  {0x0821, 0xF3},
+  {0x0822, 0x33},
+  {0x0823, 0x33},
+  /* Integration Time Settings */
+  {0x0202, 0x01},
+  {0x0203, 0xF8},
+  {0x0224, 0x01},
+  {0x0225, 0xF4},
+  /* Gain Setting */
+  {0x0204, 0x00},
+  {0x0205, 0x00},
+  {0x0216, 0x00},
+  {0x0217, 0x00},
+  {0x020E, 0x01},
+  {0x020F, 0x00},
+  {0x0210, 0x01},
+  {0x0211, 0x00},
+  {0x0212, 0x01},
+  {0x0213, 0x00},
+  {0x0214, 0x01},
+  {0x0215, 0x00},
+  /* HDR Settings */
+  {0x3006, 0x01},
+  {0x3007, 0x02},
+  {0x31E0, 0x03},
+  {0x31E1, 0xFF},
+  {0x31E4, 0x02},
+  /* DPC2D Settings */
+  {0x3A22, 0x20},
+  {0x3A23, 0x14},
+  {0x3A24, 0xE0},
+  {0x3A25, 0x01},
+  {0x3A26, 0xE0},
+  {0x3A2F, 0x05},
+  {0x3A30, 0x70},
+  {0x3A31, 0x04},
+  {0x3A32, 0x18},
+  {0x3A33, 0x0F},
+  {0x3A34, 0x6F},
+  {0x3A35, 0x0B},
+  {0x3A36, 0x97},
+  {0x3A37, 0x00},
+  {0x3A38, 0x01},
+  {0x3A39, 0x00},
+  /* LSC Settings */
+  {0x3A21, 0x00},
+  /* Stats Setting */
+  {0x3011, 0x00},
+  {0x3013, 0x00},
+  /* MIPI Global Timing Settings*/
+  {0x080A, 0x00},
+  {0x080B, 0xA7},
+  {0x080C, 0x00},
+  {0x080D, 0x6F},
+  {0x080E, 0x00},
+  {0x080F, 0x9F},
+  {0x0810, 0x00},
+  {0x0811, 0x5F},
+  {0x0812, 0x00},
+  {0x0813, 0x5F},
+  {0x0814, 0x00},
+  {0x0815, 0x6F},
+  {0x0816, 0x01},
+  {0x0817, 0x7F},
+  {0x0818, 0x00},
+  {0x0819, 0x4F},
+};
+
+/*
+ * Output formats. The media bus codes are indexed by the
+ * IMX230_IMAGE_ORIENTATION flip bits, as mirroring and flipping shift the
+ * colour filter pattern.
+ */
+static const struct imx230_format imx230_formats[IMX230_NUM_FORMATS] = {
+	{
+		.codes = {
+			MEDIA_BUS_FMT_SBGGR10_1X10,
+			MEDIA_BUS_FMT_SGBRG10_1X10,
+			MEDIA_BUS_FMT_SGRBG10_1X10,
+			MEDIA_BUS_FMT_SRGGB10_1X10,
+		},
+		.bpp = 10,
+		.data_format = 0x0a0a,
+	}, {
+		.codes = {
+			MEDIA_BUS_FMT_SBGGR10_DPCM8_1X8,
+			MEDIA_BUS_FMT_SGBRG10_DPCM8_1X8,
+			MEDIA_BUS_FMT_SGRBG10_DPCM8_1X8,
+			MEDIA_BUS_FMT_SRGGB10_DPCM8_1X8,
+		},
+		.bpp = 8,
+		.data_format = 0x0a08,
+	}, {
+		.codes = {
+			MEDIA_BUS_FMT_SBGGR8_1X8,
+			MEDIA_BUS_FMT_SGBRG8_1X8,
+			MEDIA_BUS_FMT_SGRBG8_1X8,
+			MEDIA_BUS_FMT_SRGGB8_1X8,
+		},
+		.bpp = 8,
+		.data_format = 0x0808,
+	},
+};
+
+/* Long to short exposure ratios of the HDR modes */
+static const s64 imx230_hdr_ratios[] = { 2, 4, 8, 16 };
+
+/* Indexed by the IMX230_TEST_PATTERN register value */
+static const char * const imx230_test_pattern_menu[] = {
+	"Disabled",
+	"Solid Colour",
+	"Colour Bars",
+	"Colour Bars With Fade to Grey",
+	"Pseudorandom Sequence (PN9)",
+};
+
+/* Indexed by enum imx230_dpc_mode */
+static const char * const imx230_dpc_mode_menu[] = {
+	"Off",
+	"Dynamic Singlets",
+	"Dynamic Singlets and Couplets",
+	"Static Map",
+	"Static Map and Dynamic",
+};
+
+/*
+ * Link frequencies used when the endpoint does not list any: the rates
+ * the mode tables were tuned for, in 10 and 8 bits per pixel, rounded to
+ * what the output PLL generates exactly.
+ */
+static const s64 link_freq[] = {
+	710000000,
+	574400000,
+	568000000,
+	460000000,
+};
+
+static const struct imx230_mode_info imx230_mode_info_data[] = {
+	{
+		.width = 5344,
+		.height = 4016,
+		.data = imx230_setting_full,
+		.data_size = ARRAY_SIZE(imx230_setting_full),
+		.exposure_max = 1704,
+		.exposure_def = 504,
+		.pixel_rate = 600000000,
+		.line_length = 6024,
+		.frame_length = 4150,
+		.crop = {
+			.left = 0,
+			.top = 0,
+			.width = 5344,
+			.height = 4016,
+		},
+		.binning = 1,
+		.hdr_mode = IMX230_HDR_MODE_FUSED,
+		.timeperframe = {
+			.numerator = 100,
+			.denominator = 2400,
+		}
+	},
+        {
+                .width = 4272,
+                .height = 2404,
+                .data = imx230_setting_4k2k,
+                .data_size = ARRAY_SIZE(imx230_setting_4k2k),
+                .exposure_max = 1704,
+                .exposure_def = 504,
+                .pixel_rate = 456000000,
+                .line_length = 6024,
+                .frame_length = 2494,
+                .crop = {
+                        .left = 536,
+                        .top = 806,
+                        .width = 4272,
+                        .height = 2404,
+                },
+                .binning = 1,
+                .hdr_mode = IMX230_HDR_MODE_FUSED,
+                .timeperframe = {
+                        .numerator = 100,
+                        .denominator = 3035,
+                }
+        },
+	{
+		.width = 2672,
+		.height = 2008,
+		.data = imx230_setting_bin2,
+		.data_size = ARRAY_SIZE(imx230_setting_bin2),
+		.exposure_max = 3310,
+		.exposure_def = 504,
+		.pixel_rate = 600000000,
+		.line_length = 6024,
+		.frame_length = 3320,
+		.crop = {
+			.left = 0,
+			.top = 0,
+			.width = 5344,
+			.height = 4016,
+		},
+		.binning = 2,
+		.timeperframe = {
+			.numerator = 100,
+			.denominator = 3000,
+		}
+	},
+	{
+		.width = 2136,
+		.height = 1202,
+		.data = imx230_setting_1080,
+		.data_size = ARRAY_SIZE(imx230_setting_1080),
+		.exposure_max = 840,
+		.exposure_def = 504,
+		.pixel_rate = 468000000,
+		.line_length = 6024,
+		.frame_length = 2584,
+		.crop = {
+			.left = 536,
+			.top = 808,
+			.width = 4272,
+			.height = 2404,
+		},
+		.binning = 2,
+		.hdr_mode = IMX230_HDR_MODE_FUSED,
+		.timeperframe = {
+			.numerator = 100,
+			.denominator = 3007,
+		}
+	},
+	{
+		.width = 1336,
+		.height = 1004,
+		.data = imx230_setting_bin4,
+		.data_size = ARRAY_SIZE(imx230_setting_bin4),
+		.exposure_max = 1650,
+		.exposure_def = 504,
+		.pixel_rate = 600000000,
+		.line_length = 6024,
+		.frame_length = 1660,
+		.crop = {
+			.left = 0,
+			.top = 0,
+			.width = 5344,
+			.height = 4016,
+		},
+		.binning = 4,
+		.timeperframe = {
+			.numerator = 100,
+			.denominator = 6000,
+		}
+	},
+        {
+                .width = 1316,
+                .height = 740,
+                .data = imx230_setting_720,
+                .data_size = ARRAY_SIZE(imx230_setting_720),
+                .exposure_max = 840,
+                .exposure_def = 504,
+                .pixel_rate = 600000000,
+                .line_length = 6024,
+                .frame_length = 830,
+                .crop = {
+                        .left = 1356,
+                        .top = 1268,
+                        .width = 2632,
+                        .height = 1480,
+                },
+                .binning = 2,
+                .hdr_mode = IMX230_HDR_MODE_FUSED,
+                .timeperframe = {
+                        .numerator = 100,
+                        .denominator = 12000,
+                }
+        },
+	{
+		.width = 1280,
+		.height = 720,
+		.data = imx230_setting_720_240fps,
+		.data_size = ARRAY_SIZE(imx230_setting_720_240fps),
+		.exposure_max = 882,
+		.exposure_def = 504,
+		.pixel_rate = 600000000,
+		.line_length = 2800,
+		.frame_length = 892,
+		.crop = {
+			.left = 1392,
+			.top = 1288,
+			.width = 2560,
+			.height = 1440,
+		},
+		.binning = 2,
+		.timeperframe = {
+			.numerator = 100,
+			.denominator = 24000,
+		}
+	},
+	{
+		.width = 640,
+		.height = 480,
+		.data = imx230_setting_vga_360fps,
+		.data_size = ARRAY_SIZE(imx230_setting_vga_360fps),
+		.exposure_max = 585,
+		.exposure_def = 504,
+		.pixel_rate = 600000000,
+		.line_length = 2800,
+		.frame_length = 595,
+		.crop = {
+			.left = 1392,
+			.top = 1048,
+			.width = 2560,
+			.height = 1920,
+		},
+		.binning = 4,
+		.timeperframe = {
+			.numerator = 100,
+			.denominator = 36000,
+		}
+	},
+};
+
+/* Address write and read in one transfer, with a repeated start */
+static int imx230_read_burst(struct imx230 *imx230, u16 reg, u8 *val,
+			     u16 len)
+{
+	struct i2c_client *client = imx230->i2c_client;
+	struct i2c_msg msgs[2];
+	u8 regbuf[2];
+	int ret;
+
+	regbuf[0] = reg >> 8;
+	regbuf[1] = reg & 0xff;
+
+	msgs[0].addr = client->addr;
+	msgs[0].flags = 0;
+	msgs[0].len = sizeof(regbuf);
+	msgs[0].buf = regbuf;
+
+	msgs[1].addr = client->addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = len;
+	msgs[1].buf = val;
+
+	ret = i2c_transfer(client->adapter, msgs, ARRAY_SIZE(msgs));
+	if (ret != ARRAY_SIZE(msgs)) {
+		if (ret >= 0)
+			ret = -EIO;
+		dev_err(imx230->dev, "%s: read reg error %d: reg=%x, len=%u\n",
+			__func__, ret, reg, len);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int imx230_read_reg(struct imx230 *imx230, u16 reg, u8 *val)
+{
+	return imx230_read_burst(imx230, reg, val, 1);
+}
+
+static int imx230_write_reg(struct imx230 *imx230, u16 reg, u8 val)
+{
+	u8 regbuf[3];
+	int ret;
+
+	regbuf[0] = reg >> 8;
+	regbuf[1] = reg & 0xff;
+	regbuf[2] = val;
+
+	ret = i2c_master_send(imx230->i2c_client, regbuf, 3);
+	if (ret < 0) {
+		dev_err(imx230->dev, "%s: write reg error %d: reg=%x, val=%x\n",
+			__func__, ret, reg, val);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int imx230_regulators_enable(struct imx230 *imx230)
+{
+	int ret;
+
+	ret = regulator_enable(imx230->io_regulator);
+	if (ret < 0) {
+		dev_err(imx230->dev, "set io voltage failed\n");
+		return ret;
+	}
+
+	ret = regulator_enable(imx230->analog_regulator);
+	if (ret) {
+		dev_err(imx230->dev, "set analog voltage failed\n");
+		goto err_disable_io;
+	}
+
+	ret = regulator_enable(imx230->core_regulator);
+	if (ret) {
 		dev_err(imx230->dev, "set core voltage failed\n");
 		goto err_disable_analog;
 	}
 
-	return 0;
+	return 0;
+
+err_disable_analog:
+	regulator_disable(imx230->analog_regulator);
+err_disable_io:
+	regulator_disable(imx230->io_regulator);
+
+	return ret;
+}
+
+static void imx230_regulators_disable(struct imx230 *imx230)
+{
+	int ret;
+
+	ret = regulator_disable(imx230->core_regulator);
+	if (ret < 0)
+		dev_err(imx230->dev, "core regulator disable failed\n");
+
+	ret = regulator_disable(imx230->analog_regulator);
+	if (ret < 0)
+		dev_err(imx230->dev, "analog regulator disable failed\n");
+
+	ret = regulator_disable(imx230->io_regulator);
+	if (ret < 0)
+		dev_err(imx230->dev, "io regulator disable failed\n");
+}
+
+static int imx230_write_burst(struct imx230 *imx230, u16 reg,
+			      const u8 *val, unsigned int len)
+{
+	u8 regbuf[2 + IMX230_BURST_MAX];
+	int ret;
+
+	if (len > IMX230_BURST_MAX)
+		return -EINVAL;
+
+	regbuf[0] = reg >> 8;
+	regbuf[1] = reg & 0xff;
+	memcpy(&regbuf[2], val, len);
+
+	ret = i2c_master_send(imx230->i2c_client, regbuf, len + 2);
+	if (ret < 0) {
+		dev_err(imx230->dev, "%s: write reg error %d: reg=%x, len=%u\n",
+			__func__, ret, reg, len);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int imx230_write_reg16(struct imx230 *imx230, u16 reg, u16 val)
+{
+	u8 buf[2];
+
+	put_unaligned_be16(val, buf);
+
+	return imx230_write_burst(imx230, reg, buf, 2);
+}
+
+/*
+ * The sensor auto-increments the register address within a write, so runs
+ * of consecutive registers in a table go out as a single i2c message.
+ */
+static int imx230_set_register_array(struct imx230 *imx230,
+				     const struct reg_value *settings,
+				     unsigned int num_settings)
+{
+	u8 buf[IMX230_BURST_MAX];
+	unsigned int i, n;
+	int ret;
+
+	for (i = 0; i < num_settings; i += n) {
+		buf[0] = settings[i].val;
+		for (n = 1; i + n < num_settings && n < IMX230_BURST_MAX &&
+		     settings[i + n].reg == settings[i].reg + n; n++)
+			buf[n] = settings[i + n].val;
+
+		ret = imx230_write_burst(imx230, settings[i].reg, buf, n);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Copy the OTP pages into imx230->otp. The sensor must be powered. */
+static int imx230_read_otp(struct imx230 *imx230)
+{
+	unsigned int page, waited;
+	u8 status;
+	int ret;
+
+	for (page = 0; page < IMX230_OTP_PAGES; page++) {
+		ret = imx230_write_reg(imx230, IMX230_OTP_PAGE, page);
+		if (ret < 0)
+			return ret;
+
+		ret = imx230_write_reg(imx230, IMX230_OTP_CTRL,
+				       IMX230_OTP_CTRL_READ);
+		if (ret < 0)
+			return ret;
+
+		for (waited = 0; ; waited += 100) {
+			ret = imx230_read_reg(imx230, IMX230_OTP_STATUS,
+					      &status);
+			if (ret < 0)
+				return ret;
+			if (status & IMX230_OTP_STATUS_READY)
+				break;
+			if (waited >= IMX230_OTP_TIMEOUT_US)
+				return -ETIMEDOUT;
+			usleep_range(100, 200);
+		}
+
+		ret = imx230_read_burst(imx230, IMX230_OTP_DATA,
+				&imx230->otp[page * IMX230_OTP_PAGE_SIZE],
+				IMX230_OTP_PAGE_SIZE);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int imx230_otp_read(void *priv, unsigned int offset, void *val,
+			   size_t bytes)
+{
+	struct imx230 *imx230 = priv;
+
+	memcpy(val, &imx230->otp[offset], bytes);
+
+	return 0;
+}
+
+/* Expose the cached OTP, module info and factory calibration, via nvmem */
+static void imx230_register_otp(struct imx230 *imx230)
+{
+	struct nvmem_config config = {
+		.dev = imx230->dev,
+		.owner = THIS_MODULE,
+		.read_only = true,
+		.reg_read = imx230_otp_read,
+		.size = sizeof(imx230->otp),
+		.word_size = 1,
+		.stride = 1,
+		.priv = imx230,
+	};
+
+	imx230->otp_nvmem = nvmem_register(&config);
+	if (IS_ERR(imx230->otp_nvmem)) {
+		dev_err(imx230->dev, "could not register otp nvmem\n");
+		imx230->otp_nvmem = NULL;
+	}
+}
+
+static int imx230_set_power_on(struct imx230 *imx230)
+{
+	int ret;
+
+	dev_err(imx230->dev,"AKHIL___%s__\n",__func__);
+	ret = imx230_regulators_enable(imx230);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = clk_prepare_enable(imx230->xclk);
+	if (ret < 0) {
+		dev_err(imx230->dev, "clk prepare enable failed\n");
+		imx230_regulators_disable(imx230);
+		return ret;
+	}
+
+	usleep_range(5000, 15000);
+	gpiod_set_value_cansleep(imx230->enable_gpio, 1);
+
+	usleep_range(1000, 2000);
+	gpiod_set_value_cansleep(imx230->rst_gpio, 0);
+
+	//msleep(20);
+	//gpiod_set_value_cansleep(imx230->rst_gpio, 1);
+	msleep(20);
+
+	return 0;
+}
+
+static void imx230_set_power_off(struct imx230 *imx230)
+{
+	gpiod_set_value_cansleep(imx230->rst_gpio, 1);
+	gpiod_set_value_cansleep(imx230->enable_gpio, 0);
+	clk_disable_unprepare(imx230->xclk);
+	imx230_regulators_disable(imx230);
+}
+
+static int imx230_s_power(struct v4l2_subdev *sd, int on)
+{
+	struct imx230 *imx230 = to_imx230(sd);
+	int ret = 0;
+
+	mutex_lock(&imx230->power_lock);
+
+	/* If the power count is modified from 0 to != 0 or from != 0 to 0,
+	 * update the power state.
+	 */
+
+	dev_err(imx230->dev,"AKHIL___%s__\n",__func__);
+//	if (imx230->power_count == !on) {
+	if (imx230->power_on == !!on){
+		goto exit;
+	}
+
+		if (on) {
+			mutex_lock(&imx230_lock);
+
+			ret = imx230_set_power_on(imx230);
+			if (ret < 0)
+				goto exit;
+/*
+			ret = imx230_write_reg_to(imx230, 0x3100,
+						imx230->i2c_client->addr << 1, 0x3c);
+			if (ret < 0) {
+				dev_err(imx230->dev,
+					"could not change i2c address\n");
+				imx230_set_power_off(imx230);
+				mutex_unlock(&imx230_lock);
+				goto exit;
+			}
+*/
+			mutex_unlock(&imx230_lock);
+
+			ret = imx230_set_register_array(imx230,
+					imx230_global_init_setting,
+					ARRAY_SIZE(imx230_global_init_setting));
+			if (ret < 0) {
+				dev_err(imx230->dev,
+					"could not set init registers\n");
+				imx230_set_power_off(imx230);
+				goto exit;
+			}
+
+			mutex_lock(imx230->ctrls.lock);
+			imx230->programmed_mode = NULL;
+			imx230->ctrls_dirty = IMX230_CTRLS_ALL;
+			imx230->lsc_dirty = imx230->lsc_loaded;
+			imx230->dpc_dirty = imx230->dpc_count;
+			mutex_unlock(imx230->ctrls.lock);
+/*
+			ret = imx230_write_reg(imx230, IMX230_SYSTEM_CTRL0,
+					       IMX230_SYSTEM_CTRL0_STOP);
+			if (ret < 0) {
+				imx230_set_power_off(imx230);
+				goto exit;
+			}
+*/
+			imx230->power_on = true;
+		} else {
+			imx230_set_power_off(imx230);
+			imx230->power_on = false;
+
+			/* An open hold went with the register state */
+			mutex_lock(imx230->ctrls.lock);
+			imx230->hold_count = 0;
+			mutex_unlock(imx230->ctrls.lock);
+		}
+//	}
+
+	/* Update the power count. */
+//	imx230->power_count += on ? 1 : -1;
+//	WARN_ON(imx230->power_count < 0);
+
+exit:
+	mutex_unlock(&imx230->power_lock);
+
+	dev_err(imx230->dev,"AKHIL___%s2__ret==%d__\n",__func__,ret);
+	return ret;
+}
+
+static struct v4l2_mbus_framefmt *
+__imx230_get_pad_format(struct imx230 *imx230,
+			struct v4l2_subdev_pad_config *cfg,
+			unsigned int pad,
+			enum v4l2_subdev_format_whence which)
+{
+	switch (which) {
+	case V4L2_SUBDEV_FORMAT_TRY:
+		return v4l2_subdev_get_try_format(&imx230->sd, cfg, pad);
+	case V4L2_SUBDEV_FORMAT_ACTIVE:
+		return &imx230->fmt;
+	default:
+		return NULL;
+	}
+}
+
+/* Smallest output the scaler can make from @size readout pixels */
+static inline u32 imx230_scaled_min(u32 size)
+{
+	return ALIGN(DIV_ROUND_UP(size * IMX230_SCALE_M_MIN,
+				  IMX230_SCALE_M_MAX), 2);
+}
+
+/*
+ * Index of the lowest allowed link frequency whose lanes carry full width
+ * lines of @mode in @format at its line rate, -EINVAL if none can.
+ */
+static int imx230_link_freq_index(struct imx230 *imx230,
+				  const struct imx230_mode_info *mode,
+				  const struct imx230_format *format)
+{
+	u64 bitrate = div_u64((u64)mode->width * format->bpp * mode->pixel_rate,
+			      mode->line_length);
+	int idx = -EINVAL;
+	int i;
+
+	for (i = 0; i < imx230->nr_link_freqs; i++) {
+		if (2 * imx230->link_freqs[i] * imx230->lanes < bitrate)
+			continue;
+
+		if (idx < 0 || imx230->link_freqs[i] < imx230->link_freqs[idx])
+			idx = i;
+	}
+
+	return idx;
+}
+
+static int imx230_init_mode_caps(struct imx230 *imx230)
+{
+	struct imx230_mode_caps *caps;
+	int i, j;
+
+	caps = devm_kcalloc(imx230->dev, ARRAY_SIZE(imx230_mode_info_data),
+			    sizeof(*caps), GFP_KERNEL);
+	if (!caps)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(imx230_mode_info_data); i++) {
+		const struct imx230_mode_info *mode = &imx230_mode_info_data[i];
+
+		for (j = 0; j < IMX230_NUM_FORMATS; j++)
+			caps[i].link_freq_idx[j] = imx230_link_freq_index(
+					imx230, mode, &imx230_formats[j]);
+
+		caps[i].readout_cost = (mode->crop.width / mode->binning) *
+				       (mode->crop.height / mode->binning);
+		caps[i].min_width = imx230_scaled_min(mode->width);
+		caps[i].min_height = imx230_scaled_min(mode->height);
+	}
+
+	imx230->mode_caps = caps;
+
+	return 0;
+}
+
+static const struct imx230_mode_caps *
+imx230_mode_caps(struct imx230 *imx230, const struct imx230_mode_info *mode)
+{
+	return &imx230->mode_caps[mode - imx230_mode_info_data];
+}
+
+/* Selected link frequency index of @mode in @format, negative if none */
+static int imx230_mode_link(struct imx230 *imx230,
+			    const struct imx230_mode_info *mode,
+			    const struct imx230_format *format)
+{
+	return imx230_mode_caps(imx230, mode)->link_freq_idx[
+						format - imx230_formats];
+}
+
+/* Whether @mode runs at frame interval @ival or faster */
+static bool imx230_mode_reaches(const struct imx230_mode_info *mode,
+				const struct v4l2_fract *ival)
+{
+	return (u64)mode->timeperframe.numerator * ival->denominator <=
+	       (u64)ival->numerator * mode->timeperframe.denominator;
+}
+
+/*
+ * Select the mode with the lowest readout cost that can output
+ * @width x @height in @format at frame interval @ival, the scaler and
+ * VBLANK make up the difference. A NULL @ival takes any rate. Requests no
+ * mode meets drop the interval first, then get the largest mode the link
+ * can carry. NULL if the link carries none.
+ */
+static const struct imx230_mode_info *
+imx230_select_mode(struct imx230 *imx230, u32 width, u32 height,
+		   const struct v4l2_fract *ival,
+		   const struct imx230_format *format)
+{
+	const struct imx230_mode_info *best = NULL, *largest = NULL;
+	u32 best_cost = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(imx230_mode_info_data); i++) {
+		const struct imx230_mode_info *m = &imx230_mode_info_data[i];
+		const struct imx230_mode_caps *caps = &imx230->mode_caps[i];
+
+		if (imx230_mode_link(imx230, m, format) < 0)
+			continue;
+
+		/* Binned modes have no PDAF data for a linked PDAF pad */
+		if (imx230->pdaf && m->binning > 1)
+			continue;
+
+		if (!largest ||
+		    m->width * m->height > largest->width * largest->height)
+			largest = m;
+
+		if (m->width < width || m->height < height)
+			continue;
+
+		if (ival && !imx230_mode_reaches(m, ival))
+			continue;
+
+		if (!best || caps->readout_cost < best_cost) {
+			best = m;
+			best_cost = caps->readout_cost;
+		}
+	}
+
+	if (best)
+		return best;
+
+	if (ival)
+		return imx230_select_mode(imx230, width, height, NULL, format);
+
+	return largest;
+}
+
+/*
+ * Clamp @width x @height to the output sizes the scaler can make from
+ * @mode and return the scale factor M (output = 16 / M of the input)
+ * that keeps the widest field of view at that size. The size is rounded
+ * down to one that an even digital crop scales to exactly.
+ */
+static u32 imx230_calc_scale_m(const struct imx230_mode_info *mode,
+			       u32 *width, u32 *height)
+{
+	u32 scale_m, step;
+
+	*width = clamp_t(u32, ALIGN(*width, 2),
+			 imx230_scaled_min(mode->width), mode->width);
+	*height = clamp_t(u32, ALIGN(*height, 2),
+			  imx230_scaled_min(mode->height), mode->height);
+
+	scale_m = min(IMX230_SCALE_M_MIN * mode->width / *width,
+		      IMX230_SCALE_M_MIN * mode->height / *height);
+	scale_m = clamp_t(u32, scale_m, IMX230_SCALE_M_MIN, IMX230_SCALE_M_MAX);
+
+	/* size * M / 16 must be an even number of input pixels */
+	step = 32 / gcd(scale_m, 32);
+	*width = max(round_down(*width, step), step);
+	*height = max(round_down(*height, step), step);
+
+	return scale_m;
+}
+
+/*
+ * Long to short exposure ratio with control @id set to @val and the other
+ * HDR control unchanged, 1 if the output is linear. HDR is only on with
+ * WDR enabled in a mode that supports it.
+ */
+static u32 imx230_hdr_ratio(struct imx230 *imx230, u32 id, s32 val)
+{
+	bool wdr = id == V4L2_CID_WIDE_DYNAMIC_RANGE ? val :
+						       imx230->wdr->cur.val;
+	s32 idx = id == IMX230_CID_HDR_RATIO ? val : imx230->hdr_ratio->cur.val;
+
+	if (!wdr || !imx230->current_mode->hdr_mode)
+		return 1;
+
+	return imx230_hdr_ratios[idx];
+}
+
+/*
+ * Holds nest, the outermost one is written to the sensor. A hold that
+ * could not be written is not counted.
+ */
+static int imx230_group_hold(struct imx230 *imx230, bool hold)
+{
+	int ret;
+
+	if (!imx230->power_on)
+		return 0;
+
+	if (!hold)
+		return --imx230->hold_count ? 0 :
+		       imx230_write_reg(imx230, IMX230_GROUP_HOLD, 0);
+
+	if (!imx230->hold_count) {
+		ret = imx230_write_reg(imx230, IMX230_GROUP_HOLD, 1);
+		if (ret < 0)
+			return ret;
+	}
+	imx230->hold_count++;
+
+	return 0;
+}
+
+static int imx230_set_exposure(struct imx230 *imx230, s32 val)
+{
+	u32 ratio = imx230_hdr_ratio(imx230, 0, 0);
+	int ret, hold_ret;
+
+	ret = imx230_group_hold(imx230, true);
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_write_reg16(imx230, IMX230_EXPOSURE, val);
+	if (ret < 0 || ratio == 1)
+		goto release;
+
+	/* The short exposure follows the long one */
+	ret = imx230_write_reg16(imx230, IMX230_SHORT_EXPOSURE, val / ratio);
+
+release:
+	hold_ret = imx230_group_hold(imx230, false);
+
+	return ret ? ret : hold_ret;
+}
+
+static int imx230_set_hdr(struct imx230 *imx230, u32 id, s32 val)
+{
+	u32 ratio = imx230_hdr_ratio(imx230, id, val);
+	int ret;
+
+	ret = imx230_write_reg(imx230, IMX230_HDR_RATIO, ratio);
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_write_reg16(imx230, IMX230_SHORT_EXPOSURE,
+				 max_t(s32, imx230->exposure->cur.val / ratio,
+				       1));
+	if (ret < 0)
+		return ret;
+
+	return imx230_write_reg(imx230, IMX230_HDR_MODE,
+				ratio > 1 ? imx230->current_mode->hdr_mode :
+					    IMX230_HDR_MODE_LINEAR);
+}
+
+static int imx230_set_analog_gain(struct imx230 *imx230, s32 val)
+{
+	return imx230_write_reg16(imx230, IMX230_ANALOG_GAIN, val);
+}
+
+/* The same digital gain is applied to the Gr, R, B and Gb channels */
+static int imx230_set_digital_gain(struct imx230 *imx230, s32 val)
+{
+	u8 buf[8];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(buf); i += 2) {
+		buf[i] = val >> 8;
+		buf[i + 1] = val & 0xff;
+	}
+
+	return imx230_write_burst(imx230, IMX230_DIGITAL_GAIN_GR,
+				  buf, ARRAY_SIZE(buf));
+}
+
+/*
+ * Precompute the register split of every total gain step: as much analog
+ * gain as possible without exceeding the requested total, for the better
+ * SNR, and digital gain for the remainder.
+ */
+static void imx230_init_gain_lut(struct imx230 *imx230)
+{
+	struct imx230_gain_step *step = imx230->gain_lut;
+	u32 gain, code;
+
+	for (gain = IMX230_GAIN_MIN; gain <= IMX230_GAIN_MAX; gain++, step++) {
+		code = 512 - DIV_ROUND_UP(512 * 16, gain);
+		code = min_t(u32, code, IMX230_ANALOG_GAIN_MAX);
+
+		step->analog = code;
+		step->digital = DIV_ROUND_CLOSEST(gain * (512 - code), 32);
+	}
+}
+
+/*
+ * Called with the control handler lock held from imx230_s_ctrl(). Both
+ * halves of the gain are latched on the same frame under group hold.
+ */
+static int imx230_set_gain(struct imx230 *imx230, s32 val)
+{
+	const struct imx230_gain_step *step =
+				&imx230->gain_lut[val - IMX230_GAIN_MIN];
+	int ret, hold_ret;
+
+	ret = imx230_group_hold(imx230, true);
+	if (ret < 0)
+		return ret;
+
+	ret = __v4l2_ctrl_s_ctrl(imx230->analog_gain, step->analog);
+	if (ret < 0)
+		goto release;
+
+	ret = __v4l2_ctrl_s_ctrl(imx230->digital_gain, step->digital);
+
+release:
+	hold_ret = imx230_group_hold(imx230, false);
+
+	return ret ? ret : hold_ret;
+}
+
+/* Lines read out per frame, ahead of the digital crop and the scaler */
+static inline u32 imx230_readout_height(struct imx230 *imx230)
+{
+	return imx230->crop.height / imx230->current_mode->binning;
+}
+
+static int imx230_set_vblank(struct imx230 *imx230, s32 val)
+{
+	return imx230_write_reg16(imx230, IMX230_FRAME_LENGTH,
+				  imx230_readout_height(imx230) + val);
+}
+
+static int imx230_set_dpc_mode(struct imx230 *imx230, s32 val)
+{
+	bool mapped = val == IMX230_DPC_STATIC ||
+		      val == IMX230_DPC_STATIC_DYNAMIC;
+	bool single = val != IMX230_DPC_OFF && val != IMX230_DPC_STATIC;
+	bool couplet = val == IMX230_DPC_COUPLET ||
+		       val == IMX230_DPC_STATIC_DYNAMIC;
+	int ret;
+
+	ret = imx230_write_reg(imx230, IMX230_DPC_MAPPED_EN, mapped);
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_write_reg(imx230, IMX230_DPC_SINGLE_EN, single);
+	if (ret < 0)
+		return ret;
+
+	return imx230_write_reg(imx230, IMX230_DPC_COUPLET_EN, couplet);
+}
+
+/* The same threshold is applied to the three DPC2D detectors */
+static int imx230_set_dpc_threshold(struct imx230 *imx230, s32 val)
+{
+	u8 buf[3] = { val, val, val };
+
+	return imx230_write_burst(imx230, IMX230_DPC_THRESHOLD, buf,
+				  ARRAY_SIZE(buf));
+}
+
+/*
+ * The exposure limit grows with the frame length beyond the mode default
+ * and shrinks with it when a smaller crop allows shorter frames. The
+ * minimum keeps the short exposure of the HDR modes at least one line.
+ */
+static int imx230_update_exposure_range(struct imx230 *imx230, s32 vblank,
+					u32 ratio)
+{
+	const struct imx230_mode_info *mode = imx230->current_mode;
+	s32 frame_length = imx230_readout_height(imx230) + vblank;
+	s32 exposure_max;
+
+	if (frame_length >= mode->frame_length)
+		exposure_max = mode->exposure_max +
+			       frame_length - mode->frame_length;
+	else
+		exposure_max = min_t(s32, mode->exposure_max,
+				     frame_length - IMX230_EXPOSURE_MARGIN);
+
+	exposure_max = max_t(s32, exposure_max, ratio);
+
+	return __v4l2_ctrl_modify_range(imx230->exposure, ratio, exposure_max,
+					1, clamp_t(s32, mode->exposure_def,
+						   ratio, exposure_max));
+}
+
+/*
+ * Program the crop window into the analog address registers and the
+ * scaler. The digital crop takes the centre of the binned window that
+ * scales down to exactly the output size.
+ */
+static int imx230_set_readout(struct imx230 *imx230)
+{
+	const struct v4l2_rect *crop = &imx230->crop;
+	u32 binning = imx230->current_mode->binning;
+	u32 scale_m = imx230->scale_m;
+	u32 in_width = crop->width / binning;
+	u32 in_height = crop->height / binning;
+	u32 dig_width, dig_height;
+	u8 addr[12], dig_crop[8];
+	int ret;
+
+	dig_width = min(in_width,
+			round_down(imx230->fmt.width * scale_m / 16, 2));
+	dig_height = min(in_height,
+			 round_down(imx230->fmt.height * scale_m / 16, 2));
+
+	put_unaligned_be16(crop->left, &addr[0]);
+	put_unaligned_be16(crop->top, &addr[2]);
+	put_unaligned_be16(crop->left + crop->width - 1, &addr[4]);
+	put_unaligned_be16(crop->top + crop->height - 1, &addr[6]);
+	put_unaligned_be16(imx230->fmt.width, &addr[8]);
+	put_unaligned_be16(imx230->fmt.height, &addr[10]);
+
+	put_unaligned_be16(round_down((in_width - dig_width) / 2, 2),
+			   &dig_crop[0]);
+	put_unaligned_be16(round_down((in_height - dig_height) / 2, 2),
+			   &dig_crop[2]);
+	put_unaligned_be16(dig_width, &dig_crop[4]);
+	put_unaligned_be16(dig_height, &dig_crop[6]);
+
+	ret = imx230_write_burst(imx230, IMX230_X_ADDR_START,
+				 addr, sizeof(addr));
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_write_reg(imx230, IMX230_SCALING_MODE,
+			       scale_m > IMX230_SCALE_M_MIN ?
+			       IMX230_SCALING_MODE_HV :
+			       IMX230_SCALING_MODE_NONE);
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_write_reg16(imx230, IMX230_SCALE_M, scale_m);
+	if (ret < 0)
+		return ret;
+
+	return imx230_write_burst(imx230, IMX230_DIG_CROP_X_OFFSET,
+				  dig_crop, sizeof(dig_crop));
+}
+
+static u8 imx230_orientation(bool hflip, bool vflip)
+{
+	return (hflip ? IMX230_IMAGE_ORIENTATION_HFLIP : 0) |
+	       (vflip ? IMX230_IMAGE_ORIENTATION_VFLIP : 0);
+}
+
+static u32 imx230_get_format_code(struct imx230 *imx230,
+				  const struct imx230_format *format)
+{
+	return format->codes[imx230_orientation(imx230->hflip->cur.val,
+						imx230->vflip->cur.val)];
+}
+
+/* Format matching @code in any Bayer order, the first one if none does */
+static const struct imx230_format *imx230_find_format(u32 code)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(imx230_formats); i++)
+		for (j = 0; j < ARRAY_SIZE(imx230_formats[i].codes); j++)
+			if (imx230_formats[i].codes[j] == code)
+				return &imx230_formats[i];
+
+	return &imx230_formats[0];
+}
+
+/*
+ * Binning mixes the phase detection pixels with their neighbours, PDAF
+ * data is only output in unbinned modes.
+ */
+static bool imx230_pdaf_enabled(struct imx230 *imx230)
+{
+	return imx230->pdaf && imx230->current_mode->binning == 1;
+}
+
+/*
+ * Output PLL pre-divider and multiplier running the PLL at @lane_rate
+ * exactly from the 24 MHz clock, trying the largest pre-divider first.
+ * Returns false if no pre-divider gives an integer multiplier.
+ */
+static bool imx230_op_pll(u64 lane_rate, u32 *pre_div, u32 *mpy)
+{
+	u32 div, rem;
+
+	for (div = IMX230_OP_PRE_DIV_MAX; div >= IMX230_OP_PRE_DIV_MIN; div--) {
+		*mpy = div_u64_rem(lane_rate * div, IMX230_XCLK_FREQ, &rem);
+		if (!rem) {
+			*pre_div = div;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Program the output data format, lane count, embedded data, statistics
+ * and PDAF output, and the output PLL and CSI-2 data rate for the selected
+ * link frequency. The PLL runs at the lane rate, divided by the bits per
+ * pixel for the output pixel clock.
+ */
+static int imx230_set_data_rate(struct imx230 *imx230)
+{
+	u64 lane_rate = 2 * imx230->link_freqs[imx230->link_freq->cur.val];
+	u32 pre_div, mpy;
+	u8 div[4], pll[3], rate[4];
+	int ret;
+
+	ret = imx230_write_reg16(imx230, IMX230_CSI_DATA_FORMAT,
+				 imx230->current_format->data_format);
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_write_reg(imx230, IMX230_CSI_LANE_MODE, imx230->lanes - 1);
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_write_reg(imx230, IMX230_EBD_SIZE_V,
+			       imx230->embedded_data ?
+			       IMX230_EMBEDDED_LINES : 0);
+	if (ret < 0)
+		return ret;
+
+	/* Statistics only go out with the embedded data */
+	ret = imx230_write_reg(imx230, IMX230_STATS_OUT_EN,
+			       imx230->embedded_data && imx230->stats->cur.val);
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_write_reg(imx230, IMX230_PDAF_CTRL,
+			       imx230_pdaf_enabled(imx230));
+	if (ret < 0)
+		return ret;
+
+	/* Only exact rates are allowed, see imx230_parse_link_freqs() */
+	if (!imx230_op_pll(lane_rate, &pre_div, &mpy))
+		return -EINVAL;
+
+	/* Output pixel and system clock dividers */
+	put_unaligned_be16(imx230->current_format->bpp, &div[0]);
+	put_unaligned_be16(1, &div[2]);
+	ret = imx230_write_burst(imx230, IMX230_OP_PIX_CLK_DIV,
+				 div, sizeof(div));
+	if (ret < 0)
+		return ret;
+
+	pll[0] = pre_div;
+	put_unaligned_be16(mpy, &pll[1]);
+	ret = imx230_write_burst(imx230, IMX230_OP_PRE_DIV, pll, sizeof(pll));
+	if (ret < 0)
+		return ret;
+
+	/*
+	 * The D-PHY timings in the mode tables suit one lane rate only. In
+	 * auto mode the sensor derives them from the data rate instead.
+	 */
+	ret = imx230_write_reg(imx230, IMX230_DPHY_CTRL, IMX230_DPHY_CTRL_AUTO);
+	if (ret < 0)
+		return ret;
+
+	/* Total Mbps over all lanes, 16.16 fixed point */
+	put_unaligned_be32(div_u64((lane_rate * imx230->lanes) << 16,
+				   1000000), rate);
+
+	return imx230_write_burst(imx230, IMX230_DATA_RATE, rate, sizeof(rate));
+}
+
+/* Orientation with flip control @id set to @val and the other unchanged */
+static u8 imx230_new_orientation(struct imx230 *imx230, u32 id, s32 val)
+{
+	bool hflip = id == V4L2_CID_HFLIP ? val : imx230->hflip->cur.val;
+	bool vflip = id == V4L2_CID_VFLIP ? val : imx230->vflip->cur.val;
+
+	return imx230_orientation(hflip, vflip);
+}
+
+static int imx230_set_flip(struct imx230 *imx230, u32 id, s32 val)
+{
+	return imx230_write_reg(imx230, IMX230_IMAGE_ORIENTATION,
+				imx230_new_orientation(imx230, id, val));
+}
+
+static int imx230_ctrl_index(u32 id)
+{
+	switch (id) {
+	case V4L2_CID_EXPOSURE:
+		return IMX230_CTRL_EXPOSURE;
+	case V4L2_CID_ANALOGUE_GAIN:
+		return IMX230_CTRL_ANALOG_GAIN;
+	case V4L2_CID_DIGITAL_GAIN:
+		return IMX230_CTRL_DIGITAL_GAIN;
+	case V4L2_CID_HFLIP:
+	case V4L2_CID_VFLIP:
+		return IMX230_CTRL_ORIENTATION;
+	case V4L2_CID_VBLANK:
+		return IMX230_CTRL_FRAME_LENGTH;
+	case V4L2_CID_WIDE_DYNAMIC_RANGE:
+	case IMX230_CID_HDR_RATIO:
+		return IMX230_CTRL_HDR;
+	case IMX230_CID_DPC_MODE:
+		return IMX230_CTRL_DPC_MODE;
+	case IMX230_CID_DPC_THRESHOLD:
+		return IMX230_CTRL_DPC_THRESHOLD;
+	case V4L2_CID_TEST_PATTERN:
+		return IMX230_CTRL_TEST_PATTERN;
+	case V4L2_CID_TEST_PATTERN_RED:
+		return IMX230_CTRL_TEST_PATTERN_RED;
+	case V4L2_CID_TEST_PATTERN_GREENR:
+		return IMX230_CTRL_TEST_PATTERN_GREENR;
+	case V4L2_CID_TEST_PATTERN_BLUE:
+		return IMX230_CTRL_TEST_PATTERN_BLUE;
+	case V4L2_CID_TEST_PATTERN_GREENB:
+		return IMX230_CTRL_TEST_PATTERN_GREENB;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int imx230_write_ctrl(struct imx230 *imx230, u32 id, s32 val)
+{
+	switch (id) {
+	case V4L2_CID_EXPOSURE:
+		return imx230_set_exposure(imx230, val);
+	case V4L2_CID_ANALOGUE_GAIN:
+		return imx230_set_analog_gain(imx230, val);
+	case V4L2_CID_DIGITAL_GAIN:
+		return imx230_set_digital_gain(imx230, val);
+	case V4L2_CID_HFLIP:
+	case V4L2_CID_VFLIP:
+		return imx230_set_flip(imx230, id, val);
+	case V4L2_CID_VBLANK:
+		return imx230_set_vblank(imx230, val);
+	case V4L2_CID_WIDE_DYNAMIC_RANGE:
+	case IMX230_CID_HDR_RATIO:
+		return imx230_set_hdr(imx230, id, val);
+	case IMX230_CID_DPC_MODE:
+		return imx230_set_dpc_mode(imx230, val);
+	case IMX230_CID_DPC_THRESHOLD:
+		return imx230_set_dpc_threshold(imx230, val);
+	case V4L2_CID_TEST_PATTERN:
+		return imx230_write_reg16(imx230, IMX230_TEST_PATTERN, val);
+	case V4L2_CID_TEST_PATTERN_RED:
+		return imx230_write_reg16(imx230, IMX230_TEST_PATTERN_RED, val);
+	case V4L2_CID_TEST_PATTERN_GREENR:
+		return imx230_write_reg16(imx230, IMX230_TEST_PATTERN_GREENR,
+					  val);
+	case V4L2_CID_TEST_PATTERN_BLUE:
+		return imx230_write_reg16(imx230, IMX230_TEST_PATTERN_BLUE,
+					  val);
+	case V4L2_CID_TEST_PATTERN_GREENB:
+		return imx230_write_reg16(imx230, IMX230_TEST_PATTERN_GREENB,
+					  val);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Write the shading table if the sensor memory does not hold it, and
+ * enable the correction, which the mode tables turn off. Call with
+ * ctrls.lock held.
+ */
+static int imx230_set_lsc(struct imx230 *imx230)
+{
+	unsigned int i, len;
+	int ret;
+
+	for (i = 0; imx230->lsc_dirty && i < sizeof(imx230->lsc_table);
+	     i += len) {
+		len = min_t(unsigned int, sizeof(imx230->lsc_table) - i,
+			    IMX230_BURST_MAX);
+		ret = imx230_write_burst(imx230, IMX230_LSC_TABLE + i,
+					 &imx230->lsc_table[i], len);
+		if (ret < 0)
+			return ret;
+	}
+	imx230->lsc_dirty = false;
+
+	ret = imx230_write_reg(imx230, IMX230_SHADING_EN, 1);
+	if (ret < 0)
+		return ret;
+
+	return imx230_write_reg(imx230, IMX230_LSC_MODE, IMX230_LSC_MODE_TABLE);
+}
+
+/* Cache a table set through IMX230_CID_LSC_TABLE. Call with ctrls.lock. */
+static int imx230_load_lsc(struct imx230 *imx230, const u16 *gains)
+{
+	unsigned int i;
+
+	for (i = 0; i < IMX230_LSC_GAINS; i++)
+		put_unaligned_be16(gains[i], &imx230->lsc_table[2 * i]);
+
+	imx230->lsc_loaded = true;
+	imx230->lsc_dirty = true;
+
+	if (!imx230->power_on)
+		return 0;
+
+	return imx230_set_lsc(imx230);
+}
+
+/*
+ * Load the per-unit calibration file named by the optional firmware
+ * property @prop in the background and pass it to @cont, which completes
+ * @done. @done is completed right away if there is no file to load.
+ */
+static void imx230_request_table(struct imx230 *imx230, const char *prop,
+				 struct completion *done,
+				 void (*cont)(const struct firmware *, void *))
+{
+	const char *name;
+
+	if (fwnode_property_read_string(dev_fwnode(imx230->dev), prop, &name)) {
+		complete(done);
+		return;
+	}
+
+	if (request_firmware_nowait(THIS_MODULE, true, name, imx230->dev,
+				    GFP_KERNEL, imx230, cont)) {
+		dev_err(imx230->dev, "could not load %s\n", name);
+		complete(done);
+	}
+}
+
+/*
+ * Apply the sony,lsc-firmware shading table through the Lens Shading
+ * Table control. The file holds the table as written to the sensor.
+ */
+static void imx230_lsc_loaded(const struct firmware *fw, void *context)
+{
+	struct imx230 *imx230 = context;
+	u16 *gains = imx230->lsc->p_cur.p_u16;
+	unsigned int i;
+	int ret;
+
+	if (!fw) {
+		dev_err(imx230->dev, "could not load lsc table\n");
+		goto done;
+	}
+
+	if (fw->size != sizeof(imx230->lsc_table)) {
+		dev_err(imx230->dev, "invalid lsc table size %zu\n", fw->size);
+		goto release;
+	}
+
+	mutex_lock(imx230->ctrls.lock);
+	for (i = 0; i < IMX230_LSC_GAINS; i++)
+		gains[i] = min_t(u16, get_unaligned_be16(&fw->data[2 * i]),
+				 IMX230_LSC_GAIN_MAX);
+	ret = imx230_load_lsc(imx230, gains);
+	mutex_unlock(imx230->ctrls.lock);
+	if (ret < 0)
+		dev_err(imx230->dev, "could not set lsc table\n");
+
+release:
+	release_firmware(fw);
+done:
+	complete(&imx230->lsc_done);
+}
+
+/* Write the cached defect map. Call with ctrls.lock held. */
+static int imx230_set_dpc_map(struct imx230 *imx230)
+{
+	unsigned int size = imx230->dpc_count * 4;
+	unsigned int i, len;
+	int ret;
+
+	for (i = 0; i < size; i += len) {
+		len = min_t(unsigned int, size - i, IMX230_BURST_MAX);
+		ret = imx230_write_burst(imx230, IMX230_DPC_MAP + i,
+					 &imx230->dpc_map[i], len);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = imx230_write_reg(imx230, IMX230_DPC_MAP_COUNT, imx230->dpc_count);
+	if (ret < 0)
+		return ret;
+
+	imx230->dpc_dirty = false;
+
+	return 0;
+}
+
+/*
+ * Cache a map set through IMX230_CID_DEFECT_MAP, x, y pairs ended by an x
+ * of IMX230_DPC_MAP_END or the end of the array. Call with ctrls.lock.
+ */
+static int imx230_load_dpc_map(struct imx230 *imx230, const u16 *coords)
+{
+	unsigned int i;
+
+	for (i = 0; i < IMX230_DPC_MAP_MAX; i++) {
+		if (coords[2 * i] == IMX230_DPC_MAP_END)
+			break;
+
+		put_unaligned_be16(coords[2 * i], &imx230->dpc_map[4 * i]);
+		put_unaligned_be16(coords[2 * i + 1],
+				   &imx230->dpc_map[4 * i + 2]);
+	}
+
+	imx230->dpc_count = i;
+	imx230->dpc_dirty = true;
+
+	if (!imx230->power_on)
+		return 0;
+
+	return imx230_set_dpc_map(imx230);
+}
+
+/*
+ * Apply the sony,dpc-firmware defect map through the Static Defect Map
+ * control. The file holds the map as written to the sensor.
+ */
+static void imx230_dpc_map_loaded(const struct firmware *fw, void *context)
+{
+	struct imx230 *imx230 = context;
+	u16 *coords = imx230->defect_map->p_cur.p_u16;
+	unsigned int i;
+	int ret;
+
+	if (!fw) {
+		dev_err(imx230->dev, "could not load defect map\n");
+		goto done;
+	}
+
+	if (fw->size % 4 || fw->size > sizeof(imx230->dpc_map)) {
+		dev_err(imx230->dev, "invalid defect map size %zu\n", fw->size);
+		goto release;
+	}
+
+	mutex_lock(imx230->ctrls.lock);
+	for (i = 0; i < IMX230_DPC_MAP_MAX * 2; i++)
+		coords[i] = i < fw->size / 2 ?
+			    get_unaligned_be16(&fw->data[2 * i]) :
+			    IMX230_DPC_MAP_END;
+	ret = imx230_load_dpc_map(imx230, coords);
+	mutex_unlock(imx230->ctrls.lock);
+	if (ret < 0)
+		dev_err(imx230->dev, "could not set defect map\n");
+
+release:
+	release_firmware(fw);
+done:
+	complete(&imx230->dpc_done);
+}
+
+/* Frame period programmed by the current mode and VBLANK, in ns */
+static u64 imx230_frame_period_ns(struct imx230 *imx230)
+{
+	const struct imx230_mode_info *mode = imx230->current_mode;
+	u32 lines = imx230_readout_height(imx230) + imx230->vblank->cur.val;
+
+	return div_u64((u64)lines * mode->line_length * NSEC_PER_SEC,
+		       mode->pixel_rate);
+}
+
+/* Account the frames counted since the last sample. Call with ctrls.lock. */
+static int imx230_update_frame_count(struct imx230 *imx230)
+{
+	u8 count;
+	int ret;
+
+	ret = imx230_read_reg(imx230, IMX230_FRAME_COUNT, &count);
+	if (ret < 0)
+		return ret;
+
+	imx230->frame_count += (u8)(count - imx230->frame_count_last);
+	imx230->frame_count_last = count;
+
+	return 0;
+}
+
+/* The counter may restart with the stream, take a new reference */
+static int imx230_rebase_frame_count(struct imx230 *imx230)
+{
+	return imx230_read_reg(imx230, IMX230_FRAME_COUNT,
+			       &imx230->frame_count_last);
+}
+
+static unsigned long imx230_frame_work_delay(struct imx230 *imx230)
+{
+	return nsecs_to_jiffies(imx230_frame_period_ns(imx230) *
+				IMX230_FRAME_COUNT_SAMPLE);
+}
+
+/* Sample the frame counter before it can wrap */
+static void imx230_frame_work(struct work_struct *work)
+{
+	struct imx230 *imx230 = container_of(to_delayed_work(work),
+					     struct imx230, frame_work);
+
+	mutex_lock(imx230->ctrls.lock);
+	imx230_update_frame_count(imx230);
+	schedule_delayed_work(&imx230->frame_work,
+			      imx230_frame_work_delay(imx230));
+	mutex_unlock(imx230->ctrls.lock);
+}
+
+/*
+ * Output a burst of frames from the armed standby state. The work ending
+ * the burst starts a jiffy before the last frame is due and follows the
+ * frame counter from there. Call with ctrls.lock held.
+ */
+static int imx230_trigger(struct imx230 *imx230)
+{
+	u64 period = imx230_frame_period_ns(imx230);
+	u32 burst = imx230->trigger_burst->cur.val;
+	unsigned long delay;
+	int ret;
+
+	if (!imx230->streaming || !imx230->trigger_mode->cur.val)
+		return -EBUSY;
+
+	/* Still outputting the previous burst */
+	if (imx230->burst_active)
+		return -EBUSY;
+
+	imx230_update_frame_count(imx230);
+
+	ret = imx230_write_reg(imx230, IMX230_SC_MODE_SELECT,
+			       IMX230_SC_MODE_SELECT_STREAMING);
+	if (ret < 0)
+		return ret;
+
+	imx230_rebase_frame_count(imx230);
+	imx230->burst_start = imx230->frame_count_last;
+	imx230->burst_frames = burst;
+	imx230->burst_timeout = ktime_add_ns(ktime_get(), (burst + 2) * period);
+	imx230->burst_active = true;
+
+	delay = nsecs_to_jiffies(period * (burst - 1));
+	schedule_delayed_work(&imx230->trigger_work, delay > 1 ? delay - 1 : 0);
+
+	return 0;
+}
+
+/*
+ * The frame counter steps at each frame start, and the sensor ends the
+ * frame in progress before entering standby. Poll the counter without
+ * the control handler lock until the last frame of the burst starts,
+ * then request standby.
+ */
+static void imx230_trigger_work(struct work_struct *work)
+{
+	struct imx230 *imx230 = container_of(to_delayed_work(work),
+					     struct imx230, trigger_work);
+	ktime_t timeout;
+	u32 burst;
+	u8 start, count;
+	int ret;
+
+	mutex_lock(imx230->ctrls.lock);
+	burst = imx230->burst_frames;
+	start = imx230->burst_start;
+	timeout = imx230->burst_timeout;
+	mutex_unlock(imx230->ctrls.lock);
+
+	for (;;) {
+		ret = imx230_read_reg(imx230, IMX230_FRAME_COUNT, &count);
+		if (ret < 0 || (u8)(count - start) >= burst)
+			break;
+
+		/* Frames stopped, end the burst anyway */
+		if (ktime_after(ktime_get(), timeout)) {
+			dev_err(imx230->dev, "burst stopped after %u frames\n",
+				(u8)(count - start));
+			break;
+		}
+
+		usleep_range(500, 1000);
+	}
+
+	mutex_lock(imx230->ctrls.lock);
+	if (imx230->streaming)
+		imx230_write_reg(imx230, IMX230_SC_MODE_SELECT,
+				 IMX230_SC_MODE_SELECT_SW_STANDBY);
+	imx230->burst_active = false;
+	mutex_unlock(imx230->ctrls.lock);
+}
+
+static irqreturn_t imx230_trigger_irq(int irq, void *data)
+{
+	struct imx230 *imx230 = data;
+
+	mutex_lock(imx230->ctrls.lock);
+	imx230_trigger(imx230);
+	mutex_unlock(imx230->ctrls.lock);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Go back to the VBLANK from before throttling, unless it was set since.
+ * Call with ctrls.lock held.
+ */
+static void imx230_unthrottle(struct imx230 *imx230)
+{
+	if (imx230->throttled &&
+	    imx230->vblank->cur.val == imx230->throttled_vblank)
+		__v4l2_ctrl_s_ctrl(imx230->vblank, imx230->throttle_vblank);
+	imx230->throttled = false;
+}
+
+/*
+ * Halve the frame rate above the throttle temperature, and restore the
+ * frame length from before once the sensor has cooled down by
+ * IMX230_TEMP_HYSTERESIS. A zero throttle temperature disables it. Call
+ * with ctrls.lock held.
+ */
+static void imx230_throttle(struct imx230 *imx230)
+{
+	int trip = imx230->temp_throttle->cur.val * 1000;
+	u32 height = imx230_readout_height(imx230);
+	s32 vblank;
+
+	if (!imx230->throttled && trip && imx230->temperature >= trip) {
+		vblank = min_t(s32, height + 2 * imx230->vblank->cur.val,
+			       imx230->vblank->maximum);
+		imx230->throttle_vblank = imx230->vblank->cur.val;
+		if (!__v4l2_ctrl_s_ctrl(imx230->vblank, vblank)) {
+			dev_info(imx230->dev, "throttling at %d mC\n",
+				 imx230->temperature);
+			imx230->throttled_vblank = imx230->vblank->cur.val;
+			imx230->throttled = true;
+		}
+	} else if (imx230->throttled &&
+		   (!trip || imx230->temperature <
+			     trip - IMX230_TEMP_HYSTERESIS * 1000)) {
+		imx230_unthrottle(imx230);
+	}
+}
+
+static void imx230_temp_work(struct work_struct *work)
+{
+	struct imx230 *imx230 = container_of(to_delayed_work(work),
+					     struct imx230, temp_work);
+	u8 val;
+
+	mutex_lock(imx230->ctrls.lock);
+
+	if (!imx230_read_reg(imx230, IMX230_TEMP_SENS_OUT, &val)) {
+		imx230->temperature = (s8)val * 1000;
+		imx230->temp_valid = true;
+		imx230_throttle(imx230);
+	}
+
+	schedule_delayed_work(&imx230->temp_work,
+			msecs_to_jiffies(imx230->temp_interval->cur.val));
+
+	mutex_unlock(imx230->ctrls.lock);
+}
+
+/* Stop sampling and go back to the unthrottled frame rate */
+static void imx230_temp_stop(struct imx230 *imx230)
+{
+	cancel_delayed_work_sync(&imx230->temp_work);
+
+	mutex_lock(imx230->ctrls.lock);
+	imx230_unthrottle(imx230);
+	imx230->temp_valid = false;
+	mutex_unlock(imx230->ctrls.lock);
+}
+
+static umode_t imx230_hwmon_is_visible(const void *data,
+				       enum hwmon_sensor_types type,
+				       u32 attr, int channel)
+{
+	return 0444;
+}
+
+static int imx230_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+			     u32 attr, int channel, long *val)
+{
+	struct imx230 *imx230 = dev_get_drvdata(dev);
+	int ret = 0;
+
+	mutex_lock(imx230->ctrls.lock);
+
+	if (attr == hwmon_temp_max)
+		*val = imx230->temp_throttle->cur.val * 1000;
+	else if (imx230->temp_valid)
+		*val = imx230->temperature;
+	else
+		ret = -ENODATA;	/* only sampled while streaming */
+
+	mutex_unlock(imx230->ctrls.lock);
+
+	return ret;
+}
+
+static const struct hwmon_ops imx230_hwmon_ops = {
+	.is_visible = imx230_hwmon_is_visible,
+	.read = imx230_hwmon_read,
+};
+
+static const u32 imx230_temp_config[] = {
+	HWMON_T_INPUT | HWMON_T_MAX,
+	0
+};
+
+static const struct hwmon_channel_info imx230_temp = {
+	.type = hwmon_temp,
+	.config = imx230_temp_config,
+};
+
+static const struct hwmon_channel_info *imx230_hwmon_info[] = {
+	&imx230_temp,
+	NULL
+};
+
+static const struct hwmon_chip_info imx230_hwmon_chip_info = {
+	.ops = &imx230_hwmon_ops,
+	.info = imx230_hwmon_info,
+};
+
+static int imx230_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct imx230 *imx230 = container_of(ctrl->handler,
+					     struct imx230, ctrls);
+	int idx = imx230_ctrl_index(ctrl->id);
+	int ret, hold_ret;
+	bool hold;
+
+	/* The total gain is applied through the analog and digital gains */
+	if (ctrl->id == V4L2_CID_GAIN)
+		return imx230_set_gain(imx230, ctrl->val);
+
+	/* Changes the metadata format, grabbed while streaming */
+	if (ctrl->id == IMX230_CID_STATS) {
+		imx230->readout_dirty = true;
+		return 0;
+	}
+
+	if (ctrl->id == IMX230_CID_TRIGGER)
+		return imx230_trigger(imx230);
+
+	if (ctrl->id == IMX230_CID_LSC_TABLE)
+		return imx230_load_lsc(imx230, ctrl->p_new.p_u16);
+
+	if (ctrl->id == IMX230_CID_DEFECT_MAP)
+		return imx230_load_dpc_map(imx230, ctrl->p_new.p_u16);
+
+	/* Frames still in flight are not counted as dropped */
+	if (ctrl->id == IMX230_CID_DELIVERED_FRAMES) {
+		if (imx230->streaming) {
+			ret = imx230_update_frame_count(imx230);
+			if (ret < 0)
+				return ret;
+		}
+		imx230->delivered_at = imx230->frame_count;
+		return 0;
+	}
+
+	/* Not backed by a register (pixel rate, link frequency) */
+	if (idx < 0)
+		return 0;
+
+	/* The flips are grabbed while streaming, follow the Bayer order */
+	if (idx == IMX230_CTRL_ORIENTATION)
+		imx230->fmt.code = imx230->current_format->codes[
+			imx230_new_orientation(imx230, ctrl->id, ctrl->val)];
+
+	/* An exposure clamped to the new range latches on the same frame */
+	hold = idx == IMX230_CTRL_FRAME_LENGTH || idx == IMX230_CTRL_HDR;
+	if (hold) {
+		ret = imx230_group_hold(imx230, true);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (idx == IMX230_CTRL_FRAME_LENGTH) {
+		ret = imx230_update_exposure_range(imx230, ctrl->val,
+					imx230_hdr_ratio(imx230, 0, 0));
+		if (ret < 0)
+			goto release;
+	}
+
+	if (idx == IMX230_CTRL_HDR) {
+		ret = imx230_update_exposure_range(imx230,
+					imx230->vblank->cur.val,
+					imx230_hdr_ratio(imx230, ctrl->id,
+							 ctrl->val));
+		if (ret < 0)
+			goto release;
+	}
+
+	/* Written on the next stream start if the sensor is off */
+	__set_bit(idx, &imx230->ctrls_dirty);
+	ret = 0;
+	if (!imx230->power_on)
+		goto release;
+
+	ret = imx230_write_ctrl(imx230, ctrl->id, ctrl->val);
+	if (ret < 0)
+		goto release;
+
+	__clear_bit(idx, &imx230->ctrls_dirty);
+
+release:
+	if (hold) {
+		hold_ret = imx230_group_hold(imx230, false);
+		if (!ret)
+			ret = hold_ret;
+	}
+
+	return ret;
+}
+
+/*
+ * Wait up to @timeout ns for the frame counter to move on from @count.
+ * The edge is placed halfway between the last two reads.
+ */
+static int imx230_wait_frame_edge(struct imx230 *imx230, u8 *count,
+				  u64 timeout, ktime_t *edge)
+{
+	ktime_t before = ktime_get(), now;
+	ktime_t end = ktime_add_ns(before, timeout);
+	u8 val;
+	int ret;
+
+	for (;;) {
+		ret = imx230_read_reg(imx230, IMX230_FRAME_COUNT, &val);
+		if (ret < 0)
+			return ret;
+
+		now = ktime_get();
+		if (val != *count)
+			break;
+
+		if (ktime_after(now, end))
+			return -ETIMEDOUT;
+
+		before = now;
+		usleep_range(100, 200);
+	}
+
+	*count = val;
+	*edge = ktime_add_ns(before, ktime_to_ns(ktime_sub(now, before)) / 2);
+
+	return 0;
+}
+
+/*
+ * Time the frames between two frame counter edges about a second apart.
+ * The counter is only polled around the edges, the frames in between are
+ * counted by it. -ETIMEDOUT if frames stop, as on a slave missing XVS
+ * pulses.
+ */
+static int imx230_measure_frame_period(struct imx230 *imx230, u64 expected,
+				       u64 *period)
+{
+	u64 window = min_t(u64, NSEC_PER_SEC,
+			   IMX230_SYNC_MEASURE_FRAMES * expected);
+	ktime_t start, end;
+	u8 first, count, frames;
+	int ret;
+
+	ret = imx230_read_reg(imx230, IMX230_FRAME_COUNT, &count);
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_wait_frame_edge(imx230, &count, 2 * expected, &start);
+	if (ret < 0)
+		return ret;
+	first = count;
+
+	/* Sleep until half a frame before the closing edge */
+	msleep(div_u64(window - expected / 2, NSEC_PER_MSEC));
+
+	ret = imx230_read_reg(imx230, IMX230_FRAME_COUNT, &count);
+	if (ret < 0)
+		return ret;
+
+	ret = imx230_wait_frame_edge(imx230, &count, 2 * expected, &end);
+	if (ret < 0)
+		return ret;
+
+	/* A full counter wrap, frames far faster than programmed */
+	frames = count - first;
+	if (!frames)
+		return -ERANGE;
+
+	*period = div_u64(ktime_to_ns(ktime_sub(end, start)), frames);
+
+	return 0;
+}
+
+/*
+ * Measure the frame period while streaming with a sync mode set. The
+ * sensor is polled without the control handler lock, the sync status
+ * controls only report the last result.
+ */
+static void imx230_sync_work(struct work_struct *work)
+{
+	struct imx230 *imx230 = container_of(to_delayed_work(work),
+					     struct imx230, sync_work);
+	u64 expected, period = 0;
+	int ret;
+
+	mutex_lock(imx230->ctrls.lock);
+	expected = imx230_frame_period_ns(imx230);
+	mutex_unlock(imx230->ctrls.lock);
+
+	ret = imx230_measure_frame_period(imx230, expected, &period);
+	if (ret < 0 && ret != -ETIMEDOUT)
+		dev_err(imx230->dev, "could not measure frame period: %d\n",
+			ret);
+
+	mutex_lock(imx230->ctrls.lock);
+	imx230->sync_period = ret < 0 ? 0 : period;
+	imx230->sync_expected = expected;
+	mutex_unlock(imx230->ctrls.lock);
+
+	schedule_delayed_work(&imx230->sync_work,
+			      msecs_to_jiffies(IMX230_SYNC_INTERVAL_MS));
+}
+
+/*
+ * Frames the sensor produced since stream start, and how many of those
+ * counted when IMX230_CID_DELIVERED_FRAMES was set the receiver did not
+ * deliver.
+ */
+static int imx230_get_frame_counts(struct imx230 *imx230,
+				   struct v4l2_ctrl *ctrl)
+{
+	s64 dropped;
+	int ret;
+
+	if (imx230->streaming) {
+		ret = imx230_update_frame_count(imx230);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (ctrl->id == IMX230_CID_SENSOR_FRAMES) {
+		ctrl->val64 = imx230->frame_count;
+	} else {
+		dropped = imx230->delivered_at -
+			  imx230->delivered_frames->cur.val64;
+		ctrl->val64 = max_t(s64, dropped, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Sync status cluster, from the last frame period measured by sync_work.
+ * Locked if it matched the period programmed at the time, the period
+ * error is the difference in us. A slave following a master programmed
+ * for another rate shows the error of the master rate.
+ */
+static int imx230_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct imx230 *imx230 = container_of(ctrl->handler,
+					     struct imx230, ctrls);
+	s64 error;
+
+	if (ctrl->id == IMX230_CID_SENSOR_FRAMES ||
+	    ctrl->id == IMX230_CID_DROPPED_FRAMES)
+		return imx230_get_frame_counts(imx230, ctrl);
+
+	if (ctrl->id != IMX230_CID_SYNC_LOCKED)
+		return 0;
+
+	imx230->sync_locked->val = 0;
+	imx230->sync_error->val = 0;
+
+	if (!imx230->streaming || !imx230->sync_period)
+		return 0;
+
+	error = (s64)(imx230->sync_period - imx230->sync_expected);
+	imx230->sync_error->val = clamp_t(s64, div_s64(error, NSEC_PER_USEC),
+					  -IMX230_SYNC_ERROR_MAX,
+					  IMX230_SYNC_ERROR_MAX);
+	imx230->sync_locked->val = abs(error) * IMX230_SYNC_LOCK_TOLERANCE <=
+				   imx230->sync_expected;
+
+	return 0;
+}
+
+static const struct v4l2_ctrl_ops imx230_ctrl_ops = {
+	.g_volatile_ctrl = imx230_g_volatile_ctrl,
+	.s_ctrl = imx230_s_ctrl,
+};
+
+/* Read-only pipeline delays, in frames, for 3A algorithms */
+static const struct v4l2_ctrl_config imx230_delay_ctrls[] = {
+	{
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_EXPOSURE_DELAY,
+		.name = "Exposure Delay",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = IMX230_EXPOSURE_DELAY,
+		.max = IMX230_EXPOSURE_DELAY,
+		.step = 1,
+		.def = IMX230_EXPOSURE_DELAY,
+		.flags = V4L2_CTRL_FLAG_READ_ONLY,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_GAIN_DELAY,
+		.name = "Gain Delay",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = IMX230_GAIN_DELAY,
+		.max = IMX230_GAIN_DELAY,
+		.step = 1,
+		.def = IMX230_GAIN_DELAY,
+		.flags = V4L2_CTRL_FLAG_READ_ONLY,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_FRAME_LENGTH_DELAY,
+		.name = "Frame Length Delay",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = IMX230_FRAME_LENGTH_DELAY,
+		.max = IMX230_FRAME_LENGTH_DELAY,
+		.step = 1,
+		.def = IMX230_FRAME_LENGTH_DELAY,
+		.flags = V4L2_CTRL_FLAG_READ_ONLY,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_FLIP_DELAY,
+		.name = "Flip Delay",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = IMX230_FLIP_DELAY,
+		.max = IMX230_FLIP_DELAY,
+		.step = 1,
+		.def = IMX230_FLIP_DELAY,
+		.flags = V4L2_CTRL_FLAG_READ_ONLY,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_GROUP_HOLD,
+		.name = "Group Hold Controls",
+		.type = V4L2_CTRL_TYPE_BITMASK,
+		.min = 0,
+		.max = IMX230_GROUP_HOLD_EXPOSURE | IMX230_GROUP_HOLD_GAIN |
+		       IMX230_GROUP_HOLD_FRAME_LENGTH,
+		.def = IMX230_GROUP_HOLD_EXPOSURE | IMX230_GROUP_HOLD_GAIN |
+		       IMX230_GROUP_HOLD_FRAME_LENGTH,
+		.flags = V4L2_CTRL_FLAG_READ_ONLY,
+	},
+};
+
+static const struct v4l2_ctrl_config imx230_sync_ctrls[] = {
+	{
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_SYNC_LOCKED,
+		.name = "Frame Sync Locked",
+		.type = V4L2_CTRL_TYPE_BOOLEAN,
+		.min = 0,
+		.max = 1,
+		.step = 1,
+		.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_SYNC_PERIOD_ERROR,
+		.name = "Frame Period Error",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = -IMX230_SYNC_ERROR_MAX,
+		.max = IMX230_SYNC_ERROR_MAX,
+		.step = 1,
+		.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	},
+};
+
+static const struct v4l2_ctrl_config imx230_stats_ctrl = {
+	.ops = &imx230_ctrl_ops,
+	.id = IMX230_CID_STATS,
+	.name = "Sensor Statistics",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config imx230_trigger_ctrls[] = {
+	{
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_TRIGGER_MODE,
+		.name = "Triggered Capture",
+		.type = V4L2_CTRL_TYPE_BOOLEAN,
+		.min = 0,
+		.max = 1,
+		.step = 1,
+		.def = 0,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_TRIGGER,
+		.name = "Capture Trigger",
+		.type = V4L2_CTRL_TYPE_BUTTON,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_TRIGGER_BURST,
+		.name = "Trigger Burst Frames",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 1,
+		.max = IMX230_TRIGGER_BURST_MAX,
+		.step = 1,
+		.def = 1,
+	},
+};
+
+static const struct v4l2_ctrl_config imx230_hdr_ratio_ctrl = {
+	.ops = &imx230_ctrl_ops,
+	.id = IMX230_CID_HDR_RATIO,
+	.name = "HDR Exposure Ratio",
+	.type = V4L2_CTRL_TYPE_INTEGER_MENU,
+	.min = 0,
+	.max = ARRAY_SIZE(imx230_hdr_ratios) - 1,
+	.def = 0,
+	.qmenu_int = imx230_hdr_ratios,
+};
+
+/* Shading gains, 4 Bayer channels of a 13x10 grid, loaded on the sensor */
+static const struct v4l2_ctrl_config imx230_lsc_ctrl = {
+	.ops = &imx230_ctrl_ops,
+	.id = IMX230_CID_LSC_TABLE,
+	.name = "Lens Shading Table",
+	.type = V4L2_CTRL_TYPE_U16,
+	.min = 0,
+	.max = IMX230_LSC_GAIN_MAX,
+	.step = 1,
+	.def = IMX230_LSC_GAIN_UNITY,
+	.dims = { IMX230_LSC_GAINS },
+};
+
+static const struct v4l2_ctrl_config imx230_dpc_ctrls[] = {
+	{
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_DPC_MODE,
+		.name = "Defect Correction Mode",
+		.type = V4L2_CTRL_TYPE_MENU,
+		.min = 0,
+		.max = ARRAY_SIZE(imx230_dpc_mode_menu) - 1,
+		.def = IMX230_DPC_COUPLET,
+		.qmenu = imx230_dpc_mode_menu,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_DPC_THRESHOLD,
+		.name = "Defect Correction Threshold",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 0,
+		.max = 0xff,
+		.step = 1,
+		.def = IMX230_DPC_THRESHOLD_DEF,
+	}, {
+		/* x, y pairs, ended by an x of IMX230_DPC_MAP_END */
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_DEFECT_MAP,
+		.name = "Static Defect Map",
+		.type = V4L2_CTRL_TYPE_U16,
+		.min = 0,
+		.max = IMX230_DPC_MAP_END,
+		.step = 1,
+		.def = IMX230_DPC_MAP_END,
+		.dims = { IMX230_DPC_MAP_MAX * 2 },
+	},
+};
+
+static const struct v4l2_ctrl_config imx230_temp_ctrls[] = {
+	{
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_TEMP_INTERVAL,
+		.name = "Temperature Interval",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 100,
+		.max = 60000,
+		.step = 1,
+		.def = 1000,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_TEMP_THROTTLE,
+		.name = "Throttle Temperature",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 0,
+		.max = IMX230_TEMP_MAX,
+		.step = 1,
+		.def = 0,
+	},
+};
+
+static const struct v4l2_ctrl_config imx230_frame_count_ctrls[] = {
+	{
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_SENSOR_FRAMES,
+		.name = "Sensor Frames",
+		.type = V4L2_CTRL_TYPE_INTEGER64,
+		.min = 0,
+		.max = S64_MAX,
+		.step = 1,
+		.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	}, {
+		/* Set by userspace from the frames the receiver delivered */
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_DELIVERED_FRAMES,
+		.name = "Delivered Frames",
+		.type = V4L2_CTRL_TYPE_INTEGER64,
+		.min = 0,
+		.max = S64_MAX,
+		.step = 1,
+		.flags = V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+	}, {
+		.ops = &imx230_ctrl_ops,
+		.id = IMX230_CID_DROPPED_FRAMES,
+		.name = "Dropped Frames",
+		.type = V4L2_CTRL_TYPE_INTEGER64,
+		.min = 0,
+		.max = S64_MAX,
+		.step = 1,
+		.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	},
+};
+
+static const struct v4l2_ctrl_config imx230_frames_lost_ctrl = {
+	.ops = &imx230_ctrl_ops,
+	.id = IMX230_CID_FRAMES_LOST,
+	.name = "Mode Switch Frames Lost",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = INT_MAX,
+	.step = 1,
+	.def = 0,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY,
+};
+
+/* Write the controls the sensor does not hold yet. Call with ctrls.lock. */
+static int imx230_replay_ctrls(struct imx230 *imx230)
+{
+	struct v4l2_ctrl *ctrl;
+	int idx, ret;
 
-err_disable_analog:
-	regulator_disable(imx230->analog_regulator);
-err_disable_io:
-	regulator_disable(imx230->io_regulator);
+	for_each_set_bit(idx, &imx230->ctrls_dirty, IMX230_CTRL_NUM) {
+		ctrl = imx230->hw_ctrls[idx];
+		ret = imx230_write_ctrl(imx230, ctrl->id, ctrl->cur.val);
+		if (ret < 0)
+			return ret;
 
-	return ret;
+		__clear_bit(idx, &imx230->ctrls_dirty);
+	}
+
+	return 0;
 }
 
-static void imx230_regulators_disable(struct imx230 *imx230)
+/* XVS direction and master/slave selection, reset by a power cycle */
+static int imx230_set_sync(struct imx230 *imx230)
 {
+	bool master = imx230->sync_mode == IMX230_SYNC_MASTER;
 	int ret;
 
-	ret = regulator_disable(imx230->core_regulator);
+	ret = imx230_write_reg(imx230, IMX230_MC_MODE, 1);
 	if (ret < 0)
-		dev_err(imx230->dev, "core regulator disable failed\n");
+		return ret;
 
-	ret = regulator_disable(imx230->analog_regulator);
+	ret = imx230_write_reg(imx230, IMX230_MS_SEL, master);
 	if (ret < 0)
-		dev_err(imx230->dev, "analog regulator disable failed\n");
+		return ret;
 
-	ret = regulator_disable(imx230->io_regulator);
+	ret = imx230_write_reg(imx230, IMX230_XVS_IO_CTRL, master);
 	if (ret < 0)
-		dev_err(imx230->dev, "io regulator disable failed\n");
+		return ret;
+
+	return imx230_write_reg(imx230, IMX230_EXTOUT_EN, master);
 }
 
-static int imx230_set_register_array(struct imx230 *imx230,
-				     const struct reg_value *settings,
-				     unsigned int num_settings)
+/*
+ * Program the current mode followed by the dirty controls. The mode tables
+ * are skipped if the sensor still holds them from an earlier stream start.
+ * Call with ctrls.lock held.
+ */
+static int imx230_program_mode(struct imx230 *imx230)
 {
-	unsigned int i;
+	const struct imx230_mode_info *mode = imx230->current_mode;
 	int ret;
 
-	for (i = 0; i < num_settings; ++i, ++settings) {
-		ret = imx230_write_reg(imx230, settings->reg, settings->val);
-		if (ret < 0)
+	if (imx230->programmed_mode != mode) {
+		imx230->programmed_mode = NULL;
+
+		ret = imx230_set_register_array(imx230, mode->data,
+						mode->data_size);
+		if (ret < 0) {
+			dev_err(imx230->dev, "could not set mode %dx%d\n",
+				mode->width, mode->height);
+			return ret;
+		}
+
+		if (imx230->sync_mode != IMX230_SYNC_NONE) {
+			ret = imx230_set_sync(imx230);
+			if (ret < 0) {
+				dev_err(imx230->dev, "could not set frame sync\n");
+				return ret;
+			}
+		}
+
+		ret = imx230_write_reg(imx230, IMX230_TEMP_SENS_CTL, 1);
+		if (ret < 0) {
+			dev_err(imx230->dev, "could not enable temperature\n");
+			return ret;
+		}
+
+		if (imx230->lsc_loaded) {
+			ret = imx230_set_lsc(imx230);
+			if (ret < 0) {
+				dev_err(imx230->dev, "could not set lsc table\n");
+				return ret;
+			}
+		}
+
+		imx230->programmed_mode = mode;
+		imx230->ctrls_dirty |= IMX230_CTRLS_IN_MODE;
+		imx230->readout_dirty = true;
+	}
+
+	if (imx230->readout_dirty) {
+		ret = imx230_set_readout(imx230);
+		if (ret < 0) {
+			dev_err(imx230->dev, "could not set crop window\n");
+			return ret;
+		}
+
+		ret = imx230_set_data_rate(imx230);
+		if (ret < 0) {
+			dev_err(imx230->dev, "could not set data format\n");
 			return ret;
+		}
+
+		imx230->readout_dirty = false;
+		/* The frame length is relative to the readout height */
+		__set_bit(IMX230_CTRL_FRAME_LENGTH, &imx230->ctrls_dirty);
 	}
 
-	return 0;
+	if (imx230->dpc_dirty) {
+		ret = imx230_set_dpc_map(imx230);
+		if (ret < 0) {
+			dev_err(imx230->dev, "could not set defect map\n");
+			return ret;
+		}
+	}
+
+	ret = imx230_replay_ctrls(imx230);
+	if (ret < 0)
+		dev_err(imx230->dev, "could not sync v4l2 controls\n");
+
+	return ret;
 }
 
-static int imx230_set_power_on(struct imx230 *imx230)
+/*
+ * Format of the data pads, derived from the @image format.
+ *
+ * The embedded data lines lead each frame at the byte length of an image
+ * line. They hold the SMIA register dump of that frame: the frame count,
+ * and the exposure, gains and frame length that took effect on it. With
+ * statistics enabled the on-sensor AE statistics of the frame trail it
+ * in the same data type.
+ *
+ * The PDAF data is one line per row of the phase detection window grid,
+ * sent as a data type of its own after the image.
+ */
+static void imx230_fill_data_format(struct imx230 *imx230, unsigned int pad,
+				    const struct v4l2_mbus_framefmt *image,
+				    struct v4l2_mbus_framefmt *fmt)
 {
-	int ret;
+	const struct imx230_format *format = imx230_find_format(image->code);
 
-	dev_err(imx230->dev,"AKHIL___%s__\n",__func__);
-	ret = imx230_regulators_enable(imx230);
-	if (ret < 0) {
-		return ret;
-	}
+	memset(fmt, 0, sizeof(*fmt));
+	fmt->code = MEDIA_BUS_FMT_SENSOR_DATA;
+	fmt->field = V4L2_FIELD_NONE;
 
-	ret = clk_prepare_enable(imx230->xclk);
-	if (ret < 0) {
-		dev_err(imx230->dev, "clk prepare enable failed\n");
-		imx230_regulators_disable(imx230);
-		return ret;
+	if (pad == IMX230_PAD_PDAF) {
+		fmt->width = IMX230_PDAF_WIN_H * IMX230_PDAF_WIN_BYTES;
+		fmt->height = IMX230_PDAF_WIN_V;
+		return;
 	}
 
-	usleep_range(5000, 15000);
-	gpiod_set_value_cansleep(imx230->enable_gpio, 1);
+	fmt->width = image->width * format->bpp / 8;
+	fmt->height = IMX230_EMBEDDED_LINES;
+	if (imx230->stats->cur.val)
+		fmt->height += IMX230_STATS_LINES;
+}
 
-	usleep_range(1000, 2000);
-	gpiod_set_value_cansleep(imx230->rst_gpio, 0);
+static int imx230_get_format(struct v4l2_subdev *sd,
+			     struct v4l2_subdev_pad_config *cfg,
+			     struct v4l2_subdev_format *format)
+{
+	struct imx230 *imx230 = to_imx230(sd);
+	struct v4l2_mbus_framefmt *image;
 
-	//msleep(20);
-	//gpiod_set_value_cansleep(imx230->rst_gpio, 1);
-	msleep(20);
+	image = __imx230_get_pad_format(imx230, cfg, IMX230_PAD_IMAGE,
+					format->which);
+
+	if (format->pad != IMX230_PAD_IMAGE)
+		imx230_fill_data_format(imx230, format->pad, image,
+					&format->format);
+	else
+		format->format = *image;
 
 	return 0;
 }
 
-static void imx230_set_power_off(struct imx230 *imx230)
+static int imx230_enum_mbus_code(struct v4l2_subdev *sd,
+				 struct v4l2_subdev_pad_config *cfg,
+				 struct v4l2_subdev_mbus_code_enum *code)
 {
-	gpiod_set_value_cansleep(imx230->rst_gpio, 1);
-	gpiod_set_value_cansleep(imx230->enable_gpio, 0);
-	clk_disable_unprepare(imx230->xclk);
-	imx230_regulators_disable(imx230);
+	struct imx230 *imx230 = to_imx230(sd);
+
+	if (code->pad != IMX230_PAD_IMAGE) {
+		if (code->index > 0)
+			return -EINVAL;
+
+		code->code = MEDIA_BUS_FMT_SENSOR_DATA;
+		return 0;
+	}
+
+	if (code->index >= ARRAY_SIZE(imx230_formats))
+		return -EINVAL;
+
+	code->code = imx230_get_format_code(imx230,
+					    &imx230_formats[code->index]);
+
+	return 0;
 }
 
-static int imx230_s_power(struct v4l2_subdev *sd, int on)
+static int imx230_enum_frame_size(struct v4l2_subdev *subdev,
+				  struct v4l2_subdev_pad_config *cfg,
+				  struct v4l2_subdev_frame_size_enum *fse)
 {
-	struct imx230 *imx230 = to_imx230(sd);
-	int ret = 0;
+	struct imx230 *imx230 = to_imx230(subdev);
+	const struct imx230_format *format = imx230_find_format(fse->code);
+	unsigned int index = fse->index;
+	int i;
 
-	mutex_lock(&imx230->power_lock);
+	if (fse->pad != IMX230_PAD_IMAGE) {
+		struct v4l2_mbus_framefmt data;
 
-	/* If the power count is modified from 0 to != 0 or from != 0 to 0,
-	 * update the power state.
-	 */
+		if (fse->index > 0 || fse->code != MEDIA_BUS_FMT_SENSOR_DATA)
+			return -EINVAL;
 
-	dev_err(imx230->dev,"AKHIL___%s__\n",__func__);
-//	if (imx230->power_count == !on) {
-	if (imx230->power_on == !!on){
-		goto exit;
+		imx230_fill_data_format(imx230, fse->pad,
+					__imx230_get_pad_format(imx230, cfg,
+						IMX230_PAD_IMAGE, fse->which),
+					&data);
+		fse->min_width = data.width;
+		fse->max_width = data.width;
+		fse->min_height = data.height;
+		fse->max_height = data.height;
+
+		return 0;
 	}
 
-		if (on) {
-			mutex_lock(&imx230_lock);
+	if (fse->code != imx230_get_format_code(imx230, format))
+		return -EINVAL;
 
-			ret = imx230_set_power_on(imx230);
-			if (ret < 0)
-				goto exit;
-/*
-			ret = imx230_write_reg_to(imx230, 0x3100,
-						imx230->i2c_client->addr << 1, 0x3c);
-			if (ret < 0) {
-				dev_err(imx230->dev,
-					"could not change i2c address\n");
-				imx230_set_power_off(imx230);
-				mutex_unlock(&imx230_lock);
-				goto exit;
-			}
-*/
-			mutex_unlock(&imx230_lock);
+	for (i = 0; i < ARRAY_SIZE(imx230_mode_info_data); i++) {
+		const struct imx230_mode_info *mode = &imx230_mode_info_data[i];
+		const struct imx230_mode_caps *caps = &imx230->mode_caps[i];
 
-			ret = imx230_set_register_array(imx230,
-					imx230_global_init_setting,
-					ARRAY_SIZE(imx230_global_init_setting));
-			if (ret < 0) {
-				dev_err(imx230->dev,
-					"could not set init registers\n");
-				imx230_set_power_off(imx230);
-				goto exit;
-			}
-/*
-			ret = imx230_write_reg(imx230, IMX230_SYSTEM_CTRL0,
-					       IMX230_SYSTEM_CTRL0_STOP);
-			if (ret < 0) {
-				imx230_set_power_off(imx230);
-				goto exit;
-			}
-*/
-			imx230->power_on = true;
-		} else {
-			imx230_set_power_off(imx230);
-			imx230->power_on = false;
-		}
-//	}
+		if (imx230_mode_link(imx230, mode, format) < 0 || index-- > 0)
+			continue;
 
-	/* Update the power count. */
-//	imx230->power_count += on ? 1 : -1;
-//	WARN_ON(imx230->power_count < 0);
+		/* Any size down to the scaler limit can be made from a mode */
+		fse->min_width = caps->min_width;
+		fse->max_width = mode->width;
+		fse->min_height = caps->min_height;
+		fse->max_height = mode->height;
 
-exit:
-	mutex_unlock(&imx230->power_lock);
+		return 0;
+	}
 
-	dev_err(imx230->dev,"AKHIL___%s2__ret==%d__\n",__func__,ret);
-	return ret;
+	return -EINVAL;
 }
 
-static struct v4l2_mbus_framefmt *
-__imx230_get_pad_format(struct imx230 *imx230,
-			struct v4l2_subdev_pad_config *cfg,
-			unsigned int pad,
-			enum v4l2_subdev_format_whence which)
+static int imx230_enum_frame_ival(struct v4l2_subdev *subdev,
+				  struct v4l2_subdev_pad_config *cfg,
+				  struct v4l2_subdev_frame_interval_enum *fie)
+{
+	struct imx230 *imx230 = to_imx230(subdev);
+	const struct imx230_format *format = imx230_find_format(fie->code);
+	int index = fie->index;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(imx230_mode_info_data); i++) {
+		const struct imx230_mode_info *mode = &imx230_mode_info_data[i];
+		const struct imx230_mode_caps *caps = &imx230->mode_caps[i];
+
+		if (imx230_mode_link(imx230, mode, format) < 0)
+			continue;
+
+		if (fie->width > mode->width || fie->height > mode->height ||
+		    fie->width < caps->min_width ||
+		    fie->height < caps->min_height)
+			continue;
+
+		if (index-- == 0) {
+			fie->interval = mode->timeperframe;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static struct v4l2_rect *
+__imx230_get_pad_crop(struct imx230 *imx230, struct v4l2_subdev_pad_config *cfg,
+		      unsigned int pad, enum v4l2_subdev_format_whence which)
 {
 	switch (which) {
 	case V4L2_SUBDEV_FORMAT_TRY:
-		return v4l2_subdev_get_try_format(&imx230->sd, cfg, pad);
+		return v4l2_subdev_get_try_crop(&imx230->sd, cfg, pad);
 	case V4L2_SUBDEV_FORMAT_ACTIVE:
-		return &imx230->fmt;
+		return &imx230->crop;
 	default:
 		return NULL;
 	}
 }
 
-static int imx230_get_format(struct v4l2_subdev *sd,
-			     struct v4l2_subdev_pad_config *cfg,
-			     struct v4l2_subdev_format *format)
+static const struct v4l2_fract *
+imx230_requested_interval(struct imx230 *imx230)
 {
-	struct imx230 *imx230 = to_imx230(sd);
+	struct v4l2_fract *ival = &imx230->frame_interval;
+
+	return ival->numerator ? ival : NULL;
+}
+
+/*
+ * Mode behind @format. A TRY format has no mode of its own, take the one
+ * imx230_set_format() would select for it, NULL if there is none.
+ */
+static const struct imx230_mode_info *
+imx230_pad_mode(struct imx230 *imx230, const struct v4l2_mbus_framefmt *format,
+		enum v4l2_subdev_format_whence which)
+{
+	if (which == V4L2_SUBDEV_FORMAT_TRY)
+		return imx230_select_mode(imx230, format->width, format->height,
+					  imx230_requested_interval(imx230),
+					  imx230_find_format(format->code));
+
+	return imx230->current_mode;
+}
+
+/*
+ * Widest output the link frequency selected for @mode in @format carries
+ * at the mode line rate, 0 if there is none.
+ */
+static u32 imx230_link_max_width(struct imx230 *imx230,
+				 const struct imx230_mode_info *mode,
+				 const struct imx230_format *format)
+{
+	int idx = imx230_mode_link(imx230, mode, format);
+
+	if (idx < 0)
+		return 0;
+
+	return div64_u64(2 * imx230->link_freqs[idx] * imx230->lanes *
+			 mode->line_length,
+			 (u64)format->bpp * mode->pixel_rate);
+}
+
+/*
+ * Frame length giving the requested frame interval at the line time of the
+ * current mode, or the mode frame length if there is no request.
+ */
+static u32 imx230_target_frame_length(struct imx230 *imx230)
+{
+	const struct imx230_mode_info *mode = imx230->current_mode;
+	const struct v4l2_fract *ival = imx230_requested_interval(imx230);
+
+	if (!ival)
+		return mode->frame_length;
+
+	return min_t(u64, div64_u64((u64)ival->numerator * mode->pixel_rate,
+				    (u64)ival->denominator *
+				    mode->line_length),
+		     IMX230_FRAME_LENGTH_MAX);
+}
+
+/*
+ * The frame length limits follow the readout height. The default keeps
+ * the requested frame interval, or the frame rate of the mode. The
+ * exposure range is updated even if the blanking stays the same, as the
+ * frame length still changes with the height. Call with ctrls.lock held.
+ */
+static int imx230_update_vblank(struct imx230 *imx230)
+{
+	u32 height = imx230_readout_height(imx230);
+	s32 vblank_def;
+	int ret;
+
+	vblank_def = clamp_t(s32, imx230_target_frame_length(imx230) - height,
+			     IMX230_VBLANK_MIN,
+			     IMX230_FRAME_LENGTH_MAX - height);
+
+	ret = __v4l2_ctrl_modify_range(imx230->vblank, IMX230_VBLANK_MIN,
+				       IMX230_FRAME_LENGTH_MAX - height,
+				       1, vblank_def);
+	if (ret < 0)
+		return ret;
 
-	format->format = *__imx230_get_pad_format(imx230, cfg, format->pad,
-						  format->which);
+	ret = __v4l2_ctrl_s_ctrl(imx230->vblank, vblank_def);
+	if (ret < 0)
+		return ret;
 
-	return 0;
+	return imx230_update_exposure_range(imx230, imx230->vblank->cur.val,
+					    imx230_hdr_ratio(imx230, 0, 0));
 }
 
-static const struct imx230_mode_info *
-imx230_find_mode_by_size(unsigned int width, unsigned int height)
+/*
+ * Make @mode the active mode and update the controls that depend on it.
+ * imx230->fmt and imx230->current_format must already hold the new output
+ * size and format. Exposure and gain go back to their defaults, except on
+ * an in-place switch while streaming where 3A keeps its state. Call with
+ * ctrls.lock held.
+ */
+static int imx230_set_mode(struct imx230 *imx230,
+			   const struct imx230_mode_info *mode)
 {
-	unsigned int max_dist_match = (unsigned int) -1;
-	int i, n = 0;
+	int link_freq_idx;
+	int ret;
 
-	for (i = 0; i < ARRAY_SIZE(imx230_mode_info_data); i++) {
-		unsigned int dist = min(width, imx230_mode_info_data[i].width)
-				* min(height, imx230_mode_info_data[i].height);
+	link_freq_idx = imx230_mode_link(imx230, mode, imx230->current_format);
+	if (link_freq_idx < 0)
+		return link_freq_idx;
 
-		dist = imx230_mode_info_data[i].width *
-				imx230_mode_info_data[i].height +
-				width * height - 2 * dist;
+	imx230->current_mode = mode;
+	imx230->readout_dirty = true;
 
-		if (dist < max_dist_match) {
-			n = i;
-			max_dist_match = dist;
-		}
-	}
+	ret = __v4l2_ctrl_s_ctrl_int64(imx230->pixel_clock, mode->pixel_rate);
+	if (ret < 0)
+		return ret;
 
-	return &imx230_mode_info_data[n];
-}
+	ret = __v4l2_ctrl_s_ctrl(imx230->link_freq, link_freq_idx);
+	if (ret < 0)
+		return ret;
 
-static const struct v4l2_ctrl_ops imx230_ctrl_ops = {
-	.s_ctrl = NULL,//imx230_s_ctrl,
-};
+	/* Also moves the exposure into the range of the new mode */
+	ret = imx230_update_vblank(imx230);
+	if (ret < 0 || imx230->streaming)
+		return ret;
 
-static int imx230_enum_mbus_code(struct v4l2_subdev *sd,
-				 struct v4l2_subdev_pad_config *cfg,
-				 struct v4l2_subdev_mbus_code_enum *code)
-{
-	if (code->index > 0)
-		return -EINVAL;
+	ret = __v4l2_ctrl_s_ctrl(imx230->exposure,
+				 imx230->exposure->default_value);
+	if (ret < 0)
+		return ret;
 
-	code->code = MEDIA_BUS_FMT_SBGGR10_1X10;
+	return __v4l2_ctrl_s_ctrl(imx230->gain, IMX230_GAIN_MIN);
+}
 
-	return 0;
+/* Registers imx230_set_data_rate() writes over the mode tables */
+static bool imx230_reg_data_rate(u16 reg)
+{
+	return (reg >= IMX230_CSI_DATA_FORMAT && reg <= IMX230_CSI_LANE_MODE) ||
+	       (reg >= IMX230_OP_PRE_DIV && reg <= IMX230_OP_PRE_DIV + 2) ||
+	       (reg >= IMX230_DATA_RATE && reg <= IMX230_DATA_RATE + 3);
 }
 
-static int imx230_enum_frame_size(struct v4l2_subdev *subdev,
-				  struct v4l2_subdev_pad_config *cfg,
-				  struct v4l2_subdev_frame_size_enum *fse)
+/* Clock tree and MIPI timing, only changed with the sensor in standby */
+static bool imx230_reg_needs_standby(u16 reg)
 {
-	if (fse->code != MEDIA_BUS_FMT_SBGGR10_1X10)
-		return -EINVAL;
+	return (reg >= IMX230_PLL_FIRST && reg <= IMX230_PLL_LAST) ||
+	       (reg >= IMX230_MIPI_TIMING_FIRST &&
+		reg <= IMX230_MIPI_TIMING_LAST);
+}
 
-	if (fse->index >= ARRAY_SIZE(imx230_mode_info_data))
-		return -EINVAL;
+/*
+ * Stage the mode table registers that differ between the programmed mode
+ * and @mode. Call with ctrls.lock held.
+ */
+static void imx230_stage_mode(struct imx230 *imx230,
+			      const struct imx230_mode_info *mode)
+{
+	const struct imx230_mode_info *from = imx230->programmed_mode;
+	const struct reg_value *reg;
+	unsigned int i, j;
 
-	fse->min_width = imx230_mode_info_data[fse->index].width;
-	fse->max_width = imx230_mode_info_data[fse->index].width;
-	fse->min_height = imx230_mode_info_data[fse->index].height;
-	fse->max_height = imx230_mode_info_data[fse->index].height;
+	if (imx230->staged_from == from && imx230->staged_to == mode)
+		return;
 
-	return 0;
-}
+	imx230->staged_size = 0;
+	imx230->staged_standby = false;
 
-static int imx230_enum_frame_ival(struct v4l2_subdev *subdev,
-				  struct v4l2_subdev_pad_config *cfg,
-				  struct v4l2_subdev_frame_interval_enum *fie)
-{
-	int index = fie->index;
-	int i;
+	for (i = 0; i < mode->data_size; i++) {
+		reg = &mode->data[i];
+		if (imx230_reg_data_rate(reg->reg))
+			continue;
 
-	for (i = 0; i < ARRAY_SIZE(imx230_mode_info_data); i++) {
-		if (fie->width != imx230_mode_info_data[i].width ||
-		    fie->height != imx230_mode_info_data[i].height)
+		for (j = 0; from && j < from->data_size; j++)
+			if (from->data[j].reg == reg->reg)
+				break;
+		if (from && j < from->data_size &&
+		    from->data[j].val == reg->val)
 			continue;
 
-		if (index-- == 0) {
-			fie->interval = imx230_mode_info_data[i].timeperframe;
-			return 0;
-		}
+		if (imx230_reg_needs_standby(reg->reg))
+			imx230->staged_standby = true;
+		imx230->staged_regs[imx230->staged_size++] = *reg;
 	}
 
-	return -EINVAL;
+	imx230->staged_from = from;
+	imx230->staged_to = mode;
 }
 
-static struct v4l2_rect *
-__imx230_get_pad_crop(struct imx230 *imx230, struct v4l2_subdev_pad_config *cfg,
-		      unsigned int pad, enum v4l2_subdev_format_whence which)
+enum imx230_switch_path {
+	IMX230_SWITCH_ARMED,	/* triggered capture, already in standby */
+	IMX230_SWITCH_HOLD,
+	IMX230_SWITCH_STANDBY,
+};
+
+struct imx230_switch {
+	enum imx230_switch_path path;
+	u64 period;		/* of the mode switched from, in ns */
+	ktime_t start;
+	bool link_change;	/* the output PLL is reprogrammed */
+};
+
+/*
+ * Start switching the streaming sensor to @mode in @format. The receiver
+ * keeps its data type, so that cannot change. A switch that only reshapes
+ * the readout is committed under group hold. A new clock tree or link
+ * frequency needs a fast standby, which truncates the frame in progress.
+ * Call with ctrls.lock held until imx230_switch_end().
+ */
+static int imx230_switch_begin(struct imx230 *imx230,
+			       const struct imx230_mode_info *mode,
+			       const struct imx230_format *format,
+			       struct imx230_switch *sw)
 {
-	switch (which) {
-	case V4L2_SUBDEV_FORMAT_TRY:
-		return v4l2_subdev_get_try_crop(&imx230->sd, cfg, pad);
-	case V4L2_SUBDEV_FORMAT_ACTIVE:
-		return &imx230->crop;
-	default:
-		return NULL;
+	int ret;
+
+	if (format != imx230->current_format)
+		return -EBUSY;
+
+	/* WDR is grabbed, HDR cannot turn on or off with the mode */
+	if (imx230->wdr->cur.val &&
+	    !mode->hdr_mode != !imx230->current_mode->hdr_mode)
+		return -EBUSY;
+
+	imx230_stage_mode(imx230, mode);
+	sw->period = imx230_frame_period_ns(imx230);
+	sw->link_change = imx230_mode_link(imx230, mode, format) !=
+			  imx230->link_freq->cur.val;
+
+	if (imx230->trigger_mode->cur.val) {
+		sw->path = IMX230_SWITCH_ARMED;
+		ret = imx230->burst_active ? -EBUSY : 0;
+	} else if (imx230->staged_standby || sw->link_change) {
+		sw->path = IMX230_SWITCH_STANDBY;
+		imx230_update_frame_count(imx230);
+		ret = imx230_write_reg(imx230, IMX230_FAST_STANDBY_CTRL, 1);
+		if (!ret)
+			ret = imx230_write_reg(imx230, IMX230_SC_MODE_SELECT,
+					IMX230_SC_MODE_SELECT_SW_STANDBY);
+		sw->start = ktime_get();
+	} else {
+		sw->path = IMX230_SWITCH_HOLD;
+		ret = imx230_group_hold(imx230, true);
 	}
-}
 
-static inline u32 avg_fps(const struct v4l2_fract *t)
-{
-	return (t->denominator + (t->numerator >> 1)) / t->numerator;
+	return ret;
 }
 
-static const struct imx230_mode_info *
-imx230_find_mode_by_ival(struct imx230 *imx230, struct v4l2_fract *timeperframe)
+/*
+ * Commit the staged registers once imx230_set_mode() has updated the
+ * controls, and report an estimate of the frames the switch cost: the
+ * sensor cannot tell which frames were integrated across the switch.
+ * Under group hold that is one frame. Through standby it is the truncated
+ * frame and those the outage spans, and one more while the receiver locks
+ * to a new link frequency.
+ */
+static int imx230_switch_end(struct imx230 *imx230,
+			     const struct imx230_switch *sw)
 {
-	const struct imx230_mode_info *mode = imx230->current_mode;
-	int fps_req = avg_fps(timeperframe);
-	unsigned int max_dist_match = (unsigned int) -1;
-	int i, n = 0;
-
-	for (i = 0; i < ARRAY_SIZE(imx230_mode_info_data); i++) {
-		unsigned int dist;
-		int fps_tmp;
-
-		if (mode->width != imx230_mode_info_data[i].width ||
-		    mode->height != imx230_mode_info_data[i].height)
-			continue;
+	u32 lost = 0;
+	int ret = 0, end_ret = 0;
 
-		fps_tmp = avg_fps(&imx230_mode_info_data[i].timeperframe);
+	if (imx230->current_mode == imx230->staged_to) {
+		ret = imx230_set_register_array(imx230, imx230->staged_regs,
+						imx230->staged_size);
+		if (ret < 0)
+			goto release;
 
-		dist = abs(fps_req - fps_tmp);
+		imx230->programmed_mode = imx230->current_mode;
+		imx230->ctrls_dirty |= IMX230_CTRLS_IN_MODE;
+		imx230->readout_dirty = true;
+	}
 
-		if (dist < max_dist_match) {
-			n = i;
-			max_dist_match = dist;
-		}
+	/* The new mode starts from its own frame length */
+	imx230->throttled = false;
+
+	ret = imx230_program_mode(imx230);
+
+release:
+	switch (sw->path) {
+	case IMX230_SWITCH_HOLD:
+		end_ret = imx230_group_hold(imx230, false);
+		/* The first new frame was integrated at the old line timing */
+		lost = 1;
+		break;
+	case IMX230_SWITCH_STANDBY:
+		end_ret = imx230_write_reg(imx230, IMX230_SC_MODE_SELECT,
+					   IMX230_SC_MODE_SELECT_STREAMING);
+		if (!end_ret)
+			end_ret = imx230_rebase_frame_count(imx230);
+		if (!end_ret)
+			end_ret = imx230_write_reg(imx230,
+						   IMX230_FAST_STANDBY_CTRL, 0);
+		lost = 1 + sw->link_change +
+		       div64_u64(ktime_to_ns(ktime_sub(ktime_get(), sw->start)),
+				 sw->period);
+		break;
+	default:
+		break;
 	}
 
-	return &imx230_mode_info_data[n];
+	__v4l2_ctrl_s_ctrl(imx230->frames_lost, lost);
+
+	return ret ? ret : end_ret;
 }
 
 static int imx230_set_format(struct v4l2_subdev *sd,
@@ -1463,50 +4739,49 @@ static int imx230_set_format(struct v4l2_subdev *sd,
 	struct v4l2_mbus_framefmt *__format;
 	struct v4l2_rect *__crop;
 	const struct imx230_mode_info *new_mode;
-	int ret;
+	const struct imx230_format *new_format;
+	struct imx230_switch sw;
+	bool active = format->which == V4L2_SUBDEV_FORMAT_ACTIVE;
+	bool do_switch;
+	u32 width = format->format.width;
+	u32 height = format->format.height;
+	u32 scale_m;
+	int ret = 0, end_ret;
+
+	/* The data pad formats follow the image format */
+	if (format->pad != IMX230_PAD_IMAGE)
+		return imx230_get_format(sd, cfg, format);
 
 	__crop = __imx230_get_pad_crop(imx230, cfg, format->pad, format->which);
 
-	new_mode = imx230_find_mode_by_size(format->format.width,
-					    format->format.height);
-
-	__crop->width = new_mode->width;
-	__crop->height = new_mode->height;
-
-	if (format->which == V4L2_SUBDEV_FORMAT_ACTIVE) {
-		ret = v4l2_ctrl_s_ctrl_int64(imx230->pixel_clock,
-					     new_mode->pixel_clock);
-		if (ret < 0)
-			return ret;
-
-		ret = v4l2_ctrl_s_ctrl(imx230->link_freq,
-				       new_mode->link_freq);
-		if (ret < 0)
-			return ret;
+	new_format = imx230_find_format(format->format.code);
+	new_mode = imx230_select_mode(imx230, width, height,
+				      imx230_requested_interval(imx230),
+				      new_format);
+	if (!new_mode)
+		return -EINVAL;
 
-		ret = v4l2_ctrl_modify_range(imx230->exposure,
-					     1, new_mode->exposure_max,
-					     1, new_mode->exposure_def);
-		if (ret < 0)
-			return ret;
+	/* Held until the switch is committed, triggers included */
+	if (active)
+		mutex_lock(imx230->ctrls.lock);
 
-		ret = v4l2_ctrl_s_ctrl(imx230->exposure,
-				       new_mode->exposure_def);
+	/* Switched in place while streaming, as for a still capture */
+	do_switch = active && imx230->streaming;
+	if (do_switch) {
+		ret = imx230_switch_begin(imx230, new_mode, new_format, &sw);
 		if (ret < 0)
-			return ret;
+			goto unlock;
+	}
 
-		ret = v4l2_ctrl_s_ctrl(imx230->gain, 16);
-		if (ret < 0)
-			return ret;
+	scale_m = imx230_calc_scale_m(new_mode, &width, &height);
 
-		imx230->current_mode = new_mode;
-	}
+	*__crop = new_mode->crop;
 
 	__format = __imx230_get_pad_format(imx230, cfg, format->pad,
 					   format->which);
-	__format->width = __crop->width;
-	__format->height = __crop->height;
-	__format->code = MEDIA_BUS_FMT_SBGGR10_1X10;
+	__format->width = width;
+	__format->height = height;
+	__format->code = imx230_get_format_code(imx230, new_format);
 	__format->field = V4L2_FIELD_NONE;
 	__format->colorspace = V4L2_COLORSPACE_SRGB;
 	__format->ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(__format->colorspace);
@@ -1514,9 +4789,26 @@ static int imx230_set_format(struct v4l2_subdev *sd,
 				__format->colorspace, __format->ycbcr_enc);
 	__format->xfer_func = V4L2_MAP_XFER_FUNC_DEFAULT(__format->colorspace);
 
-	format->format = *__format;
+	if (active) {
+		imx230->current_format = new_format;
+		imx230->scale_m = scale_m;
+		ret = imx230_set_mode(imx230, new_mode);
 
-	return 0;
+		if (do_switch) {
+			end_ret = imx230_switch_end(imx230, &sw);
+			if (!ret)
+				ret = end_ret;
+		}
+	}
+
+	if (!ret)
+		format->format = *__format;
+
+unlock:
+	if (active)
+		mutex_unlock(imx230->ctrls.lock);
+
+	return ret;
 }
 
 static int imx230_entity_init_cfg(struct v4l2_subdev *subdev,
@@ -1539,46 +4831,187 @@ static int imx230_get_selection(struct v4l2_subdev *sd,
 {
 	struct imx230 *imx230 = to_imx230(sd);
 
-	if (sel->target != V4L2_SEL_TGT_CROP)
+	if (sel->pad != IMX230_PAD_IMAGE)
 		return -EINVAL;
 
-	sel->r = *__imx230_get_pad_crop(imx230, cfg, sel->pad,
-					sel->which);
-	return 0;
+	switch (sel->target) {
+	case V4L2_SEL_TGT_CROP:
+		sel->r = *__imx230_get_pad_crop(imx230, cfg, sel->pad,
+						sel->which);
+		return 0;
+	case V4L2_SEL_TGT_NATIVE_SIZE:
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+		sel->r.left = 0;
+		sel->r.top = 0;
+		sel->r.width = IMX230_NATIVE_WIDTH;
+		sel->r.height = IMX230_NATIVE_HEIGHT;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Set an arbitrary crop window within the binning of the pad's mode.
+ * Only the window is read out, and the output format shrinks to match
+ * with the scaler bypassed.
+ */
+static int imx230_set_selection(struct v4l2_subdev *sd,
+				struct v4l2_subdev_pad_config *cfg,
+				struct v4l2_subdev_selection *sel)
+{
+	struct imx230 *imx230 = to_imx230(sd);
+	const struct imx230_mode_info *mode;
+	struct v4l2_mbus_framefmt *__format;
+	struct v4l2_rect *__crop, rect;
+	u32 binning, min_size, max_width;
+	int ret = 0;
+
+	if (sel->pad != IMX230_PAD_IMAGE || sel->target != V4L2_SEL_TGT_CROP)
+		return -EINVAL;
+
+	/* Serialises against stream start and the controls */
+	mutex_lock(imx230->ctrls.lock);
+
+	if (sel->which == V4L2_SUBDEV_FORMAT_ACTIVE && imx230->streaming) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	__crop = __imx230_get_pad_crop(imx230, cfg, sel->pad, sel->which);
+	__format = __imx230_get_pad_format(imx230, cfg, sel->pad, sel->which);
+
+	mode = imx230_pad_mode(imx230, __format, sel->which);
+	binning = mode ? mode->binning : 1;
+	min_size = IMX230_CROP_MIN * binning;
+
+	/* The output grows with the crop, keep it within the link */
+	max_width = IMX230_NATIVE_WIDTH;
+	if (mode)
+		max_width = min_t(u32, max_width, binning *
+				  imx230_link_max_width(imx230, mode,
+					imx230_find_format(__format->code)));
+	max_width = max(max_width, min_size);
+
+	/* Even start and binned size keep the Bayer order */
+	rect.left = clamp_t(s32, sel->r.left, 0,
+			    IMX230_NATIVE_WIDTH - min_size);
+	rect.top = clamp_t(s32, sel->r.top, 0,
+			   IMX230_NATIVE_HEIGHT - min_size);
+	rect.left = ALIGN(rect.left, 2);
+	rect.top = ALIGN(rect.top, 2);
+	rect.width = clamp_t(u32, sel->r.width, min_size,
+			     min_t(u32, max_width,
+				   IMX230_NATIVE_WIDTH - rect.left));
+	rect.height = clamp_t(u32, sel->r.height, min_size,
+			      IMX230_NATIVE_HEIGHT - rect.top);
+	rect.width = round_down(rect.width, 2 * binning);
+	rect.height = round_down(rect.height, 2 * binning);
+
+	*__crop = rect;
+	__format->width = rect.width / binning;
+	__format->height = rect.height / binning;
+	sel->r = rect;
+
+	if (sel->which == V4L2_SUBDEV_FORMAT_ACTIVE) {
+		imx230->scale_m = IMX230_SCALE_M_MIN;
+		imx230->readout_dirty = true;
+		ret = imx230_update_vblank(imx230);
+	}
+
+unlock:
+	mutex_unlock(imx230->ctrls.lock);
+
+	return ret;
 }
 
 static int imx230_s_stream(struct v4l2_subdev *subdev, int enable)
 {
 	struct imx230 *imx230 = to_imx230(subdev);
+	bool was_streaming;
 	int ret;
 
 	dev_err(imx230->dev, "AKHIL::start stream\n");
 	if (enable) {
-		ret = imx230_set_register_array(imx230,
-					imx230->current_mode->data,
-					imx230->current_mode->data_size);
-		if (ret < 0) {
-			dev_err(imx230->dev, "could not set mode %dx%d\n",
-				imx230->current_mode->width,
-				imx230->current_mode->height);
-			return ret;
-		}
-		ret = v4l2_ctrl_handler_setup(&imx230->ctrls);
-		if (ret < 0) {
-			dev_err(imx230->dev, "could not sync v4l2 controls\n");
-			return ret;
-		}
-		ret = imx230_write_reg(imx230, IMX230_SC_MODE_SELECT,
-				       IMX230_SC_MODE_SELECT_STREAMING);
+		mutex_lock(imx230->ctrls.lock);
+		ret = imx230_program_mode(imx230);
+		/* Ready a switch to the full resolution still mode */
+		if (!ret)
+			imx230_stage_mode(imx230, &imx230_mode_info_data[0]);
+		mutex_unlock(imx230->ctrls.lock);
 		if (ret < 0)
 			return ret;
+
+		/* Triggered capture waits in standby with the mode loaded */
+		if (!imx230->trigger_mode->cur.val) {
+			ret = imx230_write_reg(imx230, IMX230_SC_MODE_SELECT,
+					       IMX230_SC_MODE_SELECT_STREAMING);
+			if (ret < 0)
+				return ret;
+		}
 		dev_err(imx230->dev, "start stream success\n");
+
+		mutex_lock(imx230->ctrls.lock);
+		if (!imx230->streaming && imx230->trigger_gpio)
+			enable_irq(imx230->trigger_irq);
+		imx230->streaming = true;
+		imx230->frame_count = 0;
+		imx230_rebase_frame_count(imx230);
+		__v4l2_ctrl_s_ctrl_int64(imx230->delivered_frames, 0);
+		imx230->delivered_at = 0;
+		schedule_delayed_work(&imx230->frame_work,
+				      imx230_frame_work_delay(imx230));
+		imx230->sync_period = 0;
+		mutex_unlock(imx230->ctrls.lock);
+
+		if (imx230->sync_mode != IMX230_SYNC_NONE)
+			schedule_delayed_work(&imx230->sync_work, 0);
+
+		schedule_delayed_work(&imx230->temp_work,
+			msecs_to_jiffies(imx230->temp_interval->cur.val));
+
+		/* Flipping changes the Bayer order, not allowed mid-stream */
+		v4l2_ctrl_grab(imx230->hflip, true);
+		v4l2_ctrl_grab(imx230->vflip, true);
+		v4l2_ctrl_grab(imx230->stats, true);
+		v4l2_ctrl_grab(imx230->trigger_mode, true);
+		/* Fused and linear output are different data */
+		v4l2_ctrl_grab(imx230->wdr, true);
 	} else {
+		/*
+		 * Stop triggers first, so that no burst starts or reschedules
+		 * the trigger work once it is cancelled. Keep the count of the
+		 * stream for the controls.
+		 */
+		mutex_lock(imx230->ctrls.lock);
+		was_streaming = imx230->streaming;
+		if (was_streaming)
+			imx230_update_frame_count(imx230);
+		imx230->streaming = false;
+		imx230->burst_active = false;
+		mutex_unlock(imx230->ctrls.lock);
+
+		/* Waits for the handler, which takes ctrls.lock */
+		if (was_streaming && imx230->trigger_gpio)
+			disable_irq(imx230->trigger_irq);
+
+		cancel_delayed_work_sync(&imx230->trigger_work);
+		cancel_delayed_work_sync(&imx230->frame_work);
+		cancel_delayed_work_sync(&imx230->sync_work);
+		imx230_temp_stop(imx230);
+
 		ret = imx230_write_reg(imx230, IMX230_SC_MODE_SELECT,
 				       IMX230_SC_MODE_SELECT_SW_STANDBY);
 		dev_err(imx230->dev, "start stream failed\n");
 		if (ret < 0)
 			return ret;
+
+		v4l2_ctrl_grab(imx230->hflip, false);
+		v4l2_ctrl_grab(imx230->vflip, false);
+		v4l2_ctrl_grab(imx230->stats, false);
+		v4l2_ctrl_grab(imx230->trigger_mode, false);
+		v4l2_ctrl_grab(imx230->wdr, false);
 	}
 
 	return 0;
@@ -1588,64 +5021,172 @@ static int imx230_get_frame_interval(struct v4l2_subdev *subdev,
 				     struct v4l2_subdev_frame_interval *fi)
 {
 	struct imx230 *imx230 = to_imx230(subdev);
+	const struct imx230_mode_info *mode = imx230->current_mode;
+	u32 lines = imx230_readout_height(imx230) +
+		    v4l2_ctrl_g_ctrl(imx230->vblank);
+	u32 num = lines * mode->line_length;
+	u32 den = mode->pixel_rate;
+	u32 div = gcd(num, den);
 
-	fi->interval = imx230->current_mode->timeperframe;
+	fi->interval.numerator = num / div;
+	fi->interval.denominator = den / div;
 
 	return 0;
 }
 
+/*
+ * Select the cheapest mode reaching the interval at the current output
+ * size and format, then stretch its frame length to the exact interval.
+ * A zero interval goes back to the mode default.
+ */
 static int imx230_set_frame_interval(struct v4l2_subdev *subdev,
 				     struct v4l2_subdev_frame_interval *fi)
 {
 	struct imx230 *imx230 = to_imx230(subdev);
 	const struct imx230_mode_info *new_mode;
+	int ret;
+
+	mutex_lock(imx230->ctrls.lock);
+
+	if (imx230->streaming) {
+		ret = -EBUSY;
+		goto unlock;
+	}
 
-	new_mode = imx230_find_mode_by_ival(imx230, &fi->interval);
+	if (fi->interval.numerator && fi->interval.denominator)
+		imx230->frame_interval = fi->interval;
+	else
+		imx230->frame_interval.numerator = 0;
 
+	new_mode = imx230_select_mode(imx230, imx230->fmt.width,
+				      imx230->fmt.height,
+				      imx230_requested_interval(imx230),
+				      imx230->current_format);
+
+	/*
+	 * Only change to a mode that makes the same output from its own
+	 * crop. Otherwise stretch the current mode as far as it goes.
+	 */
 	if (new_mode != imx230->current_mode) {
-		int ret;
+		u32 width = imx230->fmt.width;
+		u32 height = imx230->fmt.height;
+		u32 scale_m = imx230_calc_scale_m(new_mode, &width, &height);
+
+		if (width != imx230->fmt.width ||
+		    height != imx230->fmt.height ||
+		    !v4l2_rect_equal(&imx230->crop,
+				     &imx230->current_mode->crop)) {
+			new_mode = imx230->current_mode;
+		} else {
+			imx230->scale_m = scale_m;
+			imx230->crop = new_mode->crop;
+		}
+	}
 
-		ret = v4l2_ctrl_s_ctrl_int64(imx230->pixel_clock,
-					     new_mode->pixel_clock);
-		if (ret < 0)
-			return ret;
+	if (new_mode != imx230->current_mode)
+		ret = imx230_set_mode(imx230, new_mode);
+	else
+		ret = imx230_update_vblank(imx230);
 
-		ret = v4l2_ctrl_s_ctrl(imx230->link_freq,
-				       new_mode->link_freq);
-		if (ret < 0)
-			return ret;
+unlock:
+	mutex_unlock(imx230->ctrls.lock);
+	if (ret < 0)
+		return ret;
 
-		ret = v4l2_ctrl_modify_range(imx230->exposure,
-					     1, new_mode->exposure_max,
-					     1, new_mode->exposure_def);
-		if (ret < 0)
-			return ret;
+	return imx230_get_frame_interval(subdev, fi);
+}
 
-		ret = v4l2_ctrl_s_ctrl(imx230->exposure,
-				       new_mode->exposure_def);
-		if (ret < 0)
-			return ret;
+/*
+ * The image, and the embedded data and PDAF data when their pads are
+ * linked, go out as separate CSI-2 data types for the receiver to route
+ * to separate queues.
+ */
+static int imx230_get_frame_desc(struct v4l2_subdev *sd, unsigned int pad,
+				 struct v4l2_mbus_frame_desc *fd)
+{
+	struct imx230 *imx230 = to_imx230(sd);
+	struct v4l2_mbus_framefmt data;
+	struct v4l2_mbus_frame_desc_entry *entry = fd->entry;
+
+	entry->flags = V4L2_MBUS_FRAME_DESC_FL_LEN_MAX;
+	entry->pixelcode = imx230->fmt.code;
+	entry->length = imx230->fmt.width * imx230->fmt.height *
+			imx230->current_format->bpp / 8;
+	entry++;
+
+	if (imx230->embedded_data) {
+		imx230_fill_data_format(imx230, IMX230_PAD_META, &imx230->fmt,
+					&data);
+		entry->flags = V4L2_MBUS_FRAME_DESC_FL_LEN_MAX;
+		entry->pixelcode = data.code;
+		entry->length = data.width * data.height;
+		entry++;
+	}
 
-		ret = v4l2_ctrl_s_ctrl(imx230->gain, 16);
-		if (ret < 0)
-			return ret;
+	if (imx230_pdaf_enabled(imx230)) {
+		imx230_fill_data_format(imx230, IMX230_PAD_PDAF, &imx230->fmt,
+					&data);
+		entry->flags = V4L2_MBUS_FRAME_DESC_FL_LEN_MAX |
+			       V4L2_MBUS_FRAME_DESC_FL_BLOB;
+		entry->pixelcode = data.code;
+		entry->length = data.width * data.height;
+		entry++;
+	}
 
-		imx230->current_mode = new_mode;
+	fd->num_entries = entry - fd->entry;
+
+	return 0;
+}
+
+static int imx230_link_setup(struct media_entity *entity,
+			     const struct media_pad *local,
+			     const struct media_pad *remote, u32 flags)
+{
+	struct imx230 *imx230 = to_imx230(media_entity_to_v4l2_subdev(entity));
+	bool enable = flags & MEDIA_LNK_FL_ENABLED;
+	bool *output;
+
+	switch (local->index) {
+	case IMX230_PAD_META:
+		output = &imx230->embedded_data;
+		break;
+	case IMX230_PAD_PDAF:
+		output = &imx230->pdaf;
+		break;
+	default:
+		return 0;
 	}
 
-	fi->interval = imx230->current_mode->timeperframe;
+	if (enable == *output)
+		return 0;
+
+	if (imx230->streaming)
+		return -EBUSY;
+
+	/* Formats set while linked stay in the unbinned modes */
+	if (output == &imx230->pdaf && enable &&
+	    imx230->current_mode->binning > 1)
+		return -EINVAL;
+
+	*output = enable;
+	imx230->readout_dirty = true;
 
 	return 0;
 }
 
+static const struct media_entity_operations imx230_entity_ops = {
+	.link_setup = imx230_link_setup,
+	.link_validate = v4l2_subdev_link_validate,
+};
+
 static const struct v4l2_subdev_core_ops imx230_core_ops = {
 	.s_power = imx230_s_power,
 };
 
 static const struct v4l2_subdev_video_ops imx230_video_ops = {
 	.s_stream = imx230_s_stream,
-	.g_frame_interval = NULL,//imx230_get_frame_interval,
-	.s_frame_interval = NULL,//imx230_set_frame_interval,
+	.g_frame_interval = imx230_get_frame_interval,
+	.s_frame_interval = imx230_set_frame_interval,
 };
 
 static const struct v4l2_subdev_pad_ops imx230_subdev_pad_ops = {
@@ -1656,6 +5197,8 @@ static const struct v4l2_subdev_pad_ops imx230_subdev_pad_ops = {
 	.get_fmt = imx230_get_format,
 	.set_fmt = imx230_set_format,
 	.get_selection = imx230_get_selection,
+	.set_selection = imx230_set_selection,
+	.get_frame_desc = imx230_get_frame_desc,
 };
 
 static const struct v4l2_subdev_ops imx230_subdev_ops = {
@@ -1664,15 +5207,64 @@ static const struct v4l2_subdev_ops imx230_subdev_ops = {
 	.pad = &imx230_subdev_pad_ops,
 };
 
+/*
+ * Keep the endpoint link-frequencies the sensor can run at and the output
+ * PLL generates exactly, or the default set if the property is absent.
+ */
+static int imx230_parse_link_freqs(struct imx230 *imx230,
+				   struct v4l2_fwnode_endpoint *ep)
+{
+	u32 pre_div, mpy;
+	s64 *freqs;
+	unsigned int i;
+
+	if (!ep->nr_of_link_frequencies) {
+		imx230->link_freqs = link_freq;
+		imx230->nr_link_freqs = ARRAY_SIZE(link_freq);
+		return 0;
+	}
+
+	freqs = devm_kcalloc(imx230->dev, ep->nr_of_link_frequencies,
+			     sizeof(*freqs), GFP_KERNEL);
+	if (!freqs)
+		return -ENOMEM;
+
+	for (i = 0; i < ep->nr_of_link_frequencies; i++) {
+		if (!ep->link_frequencies[i] ||
+		    ep->link_frequencies[i] > IMX230_LINK_FREQ_MAX ||
+		    !imx230_op_pll(2 * ep->link_frequencies[i], &pre_div,
+				   &mpy)) {
+			dev_warn(imx230->dev, "ignoring link frequency %llu\n",
+				 ep->link_frequencies[i]);
+			continue;
+		}
+
+		freqs[imx230->nr_link_freqs++] = ep->link_frequencies[i];
+	}
+
+	if (!imx230->nr_link_freqs) {
+		dev_err(imx230->dev, "no usable link frequency\n");
+		return -EINVAL;
+	}
+
+	imx230->link_freqs = freqs;
+
+	return 0;
+}
+
 static int imx230_probe(struct i2c_client *client,
 			const struct i2c_device_id *id)
 {
 	struct device *dev = &client->dev;
 	struct fwnode_handle *endpoint;
+	struct v4l2_fwnode_endpoint *ep;
 	//struct device_node *endpoint;
 	struct imx230 *imx230;
 	u8 chip_id_high, chip_id_low;
 	u32 xclk_freq;
+	u32 sync_mode;
+	u32 staged_max = 0;
+	unsigned int i;
 	int ret;
 //	struct imx230_ctrls *imx230_ctrls;
 
@@ -1689,20 +5281,53 @@ static int imx230_probe(struct i2c_client *client,
 		return -EINVAL;
 	}
 
-	ret = v4l2_fwnode_endpoint_parse(endpoint, &imx230->ep);
+	ep = v4l2_fwnode_endpoint_alloc_parse(endpoint);
 	fwnode_handle_put(endpoint);
 
-	if (ret < 0) {
+	if (IS_ERR(ep)) {
 		dev_err(dev, "parsing endpoint node failed\n");
-		return ret;
+		return PTR_ERR(ep);
 	}
 
+	ret = imx230_parse_link_freqs(imx230, ep);
+	imx230->ep = *ep;
+	imx230->ep.link_frequencies = NULL;
+	imx230->ep.nr_of_link_frequencies = 0;
+	v4l2_fwnode_endpoint_free(ep);
+	if (ret < 0)
+		return ret;
+
 
 	if (imx230->ep.bus_type != V4L2_MBUS_CSI2) {
 		dev_err(dev, "invalid bus type, must be CSI2\n");
 		return -EINVAL;
 	}
 
+	imx230->lanes = imx230->ep.bus.mipi_csi2.num_data_lanes;
+	if (imx230->lanes != 2 && imx230->lanes != IMX230_LANES_MAX) {
+		dev_err(dev, "unsupported number of data lanes: %u\n",
+			imx230->lanes);
+		return -EINVAL;
+	}
+
+	ret = imx230_init_mode_caps(imx230);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < ARRAY_SIZE(imx230_mode_info_data); i++)
+		staged_max = max(staged_max,
+				 imx230_mode_info_data[i].data_size);
+	imx230->staged_regs = devm_kcalloc(dev, staged_max,
+					   sizeof(*imx230->staged_regs),
+					   GFP_KERNEL);
+	if (!imx230->staged_regs)
+		return -ENOMEM;
+
+	if (!imx230_select_mode(imx230, 0, 0, NULL, &imx230_formats[0])) {
+		dev_err(dev, "no mode fits the link frequencies\n");
+		return -EINVAL;
+	}
+
 	/* get system clock (xclk) */
 	imx230->xclk = devm_clk_get(dev, "xclk");
 	if (IS_ERR(imx230->xclk)) {
@@ -1731,6 +5356,15 @@ static int imx230_probe(struct i2c_client *client,
 		return ret;
 	}
 
+	sync_mode = IMX230_SYNC_NONE;
+	fwnode_property_read_u32(dev_fwnode(dev), "sony,sync-mode", &sync_mode);
+	if (sync_mode > IMX230_SYNC_SLAVE) {
+		dev_err(dev, "invalid sync mode %u\n", sync_mode);
+		return -EINVAL;
+	}
+	imx230->sync_mode = sync_mode;
+
+
 	imx230->io_regulator = devm_regulator_get(dev, "vdddo");
 	if (IS_ERR(imx230->io_regulator)) {
 		dev_err(dev, "cannot get io regulator\n");
@@ -1785,39 +5419,76 @@ static int imx230_probe(struct i2c_client *client,
 		return PTR_ERR(imx230->rst_gpio);
 	}
 
+	imx230->trigger_gpio = devm_gpiod_get_optional(dev, "trigger",
+						       GPIOD_IN);
+	if (IS_ERR(imx230->trigger_gpio)) {
+		dev_err(dev, "cannot get trigger gpio\n");
+		return PTR_ERR(imx230->trigger_gpio);
+	}
+
 	mutex_init(&imx230->power_lock);
+	INIT_DELAYED_WORK(&imx230->trigger_work, imx230_trigger_work);
+	INIT_DELAYED_WORK(&imx230->temp_work, imx230_temp_work);
+	INIT_DELAYED_WORK(&imx230->frame_work, imx230_frame_work);
+	INIT_DELAYED_WORK(&imx230->sync_work, imx230_sync_work);
+	imx230_init_gain_lut(imx230);
+	imx230->current_format = &imx230_formats[0];
 
 //	imx230_ctrls = &(imx230->imx230_ctrls);
-	v4l2_ctrl_handler_init(&imx230->ctrls, 7);
-/*
-	imx230_ctrls->test_pattern = v4l2_ctrl_new_std_menu_items(&imx230->ctrls, &imx230_ctrl_ops,
-				     V4L2_CID_TEST_PATTERN,
-				     ARRAY_SIZE(imx230_test_pattern_menu) - 1,/////
-				     0, 0, imx230_test_pattern_menu);
-	imx230->pixel_clock = v4l2_ctrl_new_std(&imx230->ctrls,
-						&imx230_ctrl_ops,
-						V4L2_CID_PIXEL_RATE,
-						1, INT_MAX, 1, 1);
-	imx230->link_freq = v4l2_ctrl_new_int_menu(&imx230->ctrls,
-						   &imx230_ctrl_ops,
-						   V4L2_CID_LINK_FREQ,
-						   ARRAY_SIZE(link_freq) - 1,
-						   0, link_freq);
-	if (imx230->link_freq)
-		imx230->link_freq->flags |= V4L2_CTRL_FLAG_READ_ONLY;
-*/
-	v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
-			  V4L2_CID_HFLIP, 0, 1, 1, 0);
-	v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
-			  V4L2_CID_VFLIP, 0, 1, 1, 0);
+	v4l2_ctrl_handler_init(&imx230->ctrls, 20);
+	imx230->hflip = v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
+					  V4L2_CID_HFLIP, 0, 1, 1, 0);
+	imx230->vflip = v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
+					  V4L2_CID_VFLIP, 0, 1, 1, 0);
 	imx230->exposure = v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
 					     V4L2_CID_EXPOSURE, 1, 32, 1, 32);
+	imx230->vblank = v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
+					   V4L2_CID_VBLANK, 1,
+					   IMX230_FRAME_LENGTH_MAX, 1, 1);
+	imx230->analog_gain = v4l2_ctrl_new_std(&imx230->ctrls,
+						&imx230_ctrl_ops,
+						V4L2_CID_ANALOGUE_GAIN,
+						0, IMX230_ANALOG_GAIN_MAX,
+						1, 0);
+	imx230->digital_gain = v4l2_ctrl_new_std(&imx230->ctrls,
+						 &imx230_ctrl_ops,
+						 V4L2_CID_DIGITAL_GAIN,
+						 IMX230_DIGITAL_GAIN_MIN,
+						 IMX230_DIGITAL_GAIN_MAX,
+						 1, IMX230_DIGITAL_GAIN_MIN);
 	imx230->gain = v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
-					 V4L2_CID_GAIN, 16, 1023, 1, 16);
-//	v4l2_ctrl_new_std_menu_items(&imx230->ctrls, &imx230_ctrl_ops,
-//				     V4L2_CID_TEST_PATTERN,
-//				     ARRAY_SIZE(imx230_test_pattern_menu) - 1,
-//				     0, 0, imx230_test_pattern_menu);
+					 V4L2_CID_GAIN, IMX230_GAIN_MIN,
+					 IMX230_GAIN_MAX, 1, IMX230_GAIN_MIN);
+	imx230->hw_ctrls[IMX230_CTRL_EXPOSURE] = imx230->exposure;
+	imx230->hw_ctrls[IMX230_CTRL_ANALOG_GAIN] = imx230->analog_gain;
+	imx230->hw_ctrls[IMX230_CTRL_DIGITAL_GAIN] = imx230->digital_gain;
+	imx230->hw_ctrls[IMX230_CTRL_ORIENTATION] = imx230->hflip;
+	imx230->hw_ctrls[IMX230_CTRL_FRAME_LENGTH] = imx230->vblank;
+	imx230->test_pattern = v4l2_ctrl_new_std_menu_items(&imx230->ctrls,
+				&imx230_ctrl_ops, V4L2_CID_TEST_PATTERN,
+				ARRAY_SIZE(imx230_test_pattern_menu) - 1,
+				0, 0, imx230_test_pattern_menu);
+	imx230->hw_ctrls[IMX230_CTRL_TEST_PATTERN] = imx230->test_pattern;
+	imx230->hw_ctrls[IMX230_CTRL_TEST_PATTERN_RED] =
+		v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
+				  V4L2_CID_TEST_PATTERN_RED, 0,
+				  IMX230_TEST_PATTERN_COLOUR_MAX, 1,
+				  IMX230_TEST_PATTERN_COLOUR_MAX);
+	imx230->hw_ctrls[IMX230_CTRL_TEST_PATTERN_GREENR] =
+		v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
+				  V4L2_CID_TEST_PATTERN_GREENR, 0,
+				  IMX230_TEST_PATTERN_COLOUR_MAX, 1,
+				  IMX230_TEST_PATTERN_COLOUR_MAX);
+	imx230->hw_ctrls[IMX230_CTRL_TEST_PATTERN_BLUE] =
+		v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
+				  V4L2_CID_TEST_PATTERN_BLUE, 0,
+				  IMX230_TEST_PATTERN_COLOUR_MAX, 1,
+				  IMX230_TEST_PATTERN_COLOUR_MAX);
+	imx230->hw_ctrls[IMX230_CTRL_TEST_PATTERN_GREENB] =
+		v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
+				  V4L2_CID_TEST_PATTERN_GREENB, 0,
+				  IMX230_TEST_PATTERN_COLOUR_MAX, 1,
+				  IMX230_TEST_PATTERN_COLOUR_MAX);
 	imx230->pixel_clock = v4l2_ctrl_new_std(&imx230->ctrls,
 						&imx230_ctrl_ops,
 						V4L2_CID_PIXEL_RATE,
@@ -1825,11 +5496,56 @@ static int imx230_probe(struct i2c_client *client,
 	imx230->link_freq = v4l2_ctrl_new_int_menu(&imx230->ctrls,
 						   &imx230_ctrl_ops,
 						   V4L2_CID_LINK_FREQ,
-						   ARRAY_SIZE(link_freq) - 1,
-						   0, link_freq);
+						   imx230->nr_link_freqs - 1,
+						   0, imx230->link_freqs);
 	if (imx230->link_freq)
 		imx230->link_freq->flags |= V4L2_CTRL_FLAG_READ_ONLY;
 
+	for (i = 0; i < ARRAY_SIZE(imx230_delay_ctrls); i++)
+		v4l2_ctrl_new_custom(&imx230->ctrls, &imx230_delay_ctrls[i],
+				     NULL);
+	imx230->stats = v4l2_ctrl_new_custom(&imx230->ctrls, &imx230_stats_ctrl,
+					     NULL);
+	imx230->trigger_mode = v4l2_ctrl_new_custom(&imx230->ctrls,
+						&imx230_trigger_ctrls[0], NULL);
+	v4l2_ctrl_new_custom(&imx230->ctrls, &imx230_trigger_ctrls[1], NULL);
+	imx230->trigger_burst = v4l2_ctrl_new_custom(&imx230->ctrls,
+						&imx230_trigger_ctrls[2], NULL);
+	imx230->frames_lost = v4l2_ctrl_new_custom(&imx230->ctrls,
+						&imx230_frames_lost_ctrl, NULL);
+	imx230->wdr = v4l2_ctrl_new_std(&imx230->ctrls, &imx230_ctrl_ops,
+					V4L2_CID_WIDE_DYNAMIC_RANGE,
+					0, 1, 1, 0);
+	imx230->hdr_ratio = v4l2_ctrl_new_custom(&imx230->ctrls,
+						 &imx230_hdr_ratio_ctrl, NULL);
+	imx230->hw_ctrls[IMX230_CTRL_HDR] = imx230->wdr;
+	imx230->lsc = v4l2_ctrl_new_custom(&imx230->ctrls, &imx230_lsc_ctrl,
+					   NULL);
+	imx230->hw_ctrls[IMX230_CTRL_DPC_MODE] = v4l2_ctrl_new_custom(
+			&imx230->ctrls, &imx230_dpc_ctrls[0], NULL);
+	imx230->hw_ctrls[IMX230_CTRL_DPC_THRESHOLD] = v4l2_ctrl_new_custom(
+			&imx230->ctrls, &imx230_dpc_ctrls[1], NULL);
+	imx230->defect_map = v4l2_ctrl_new_custom(&imx230->ctrls,
+						  &imx230_dpc_ctrls[2], NULL);
+	imx230->temp_interval = v4l2_ctrl_new_custom(&imx230->ctrls,
+						&imx230_temp_ctrls[0], NULL);
+	imx230->temp_throttle = v4l2_ctrl_new_custom(&imx230->ctrls,
+						&imx230_temp_ctrls[1], NULL);
+	v4l2_ctrl_new_custom(&imx230->ctrls, &imx230_frame_count_ctrls[0],
+			     NULL);
+	imx230->delivered_frames = v4l2_ctrl_new_custom(&imx230->ctrls,
+					&imx230_frame_count_ctrls[1], NULL);
+	v4l2_ctrl_new_custom(&imx230->ctrls, &imx230_frame_count_ctrls[2],
+			     NULL);
+
+	if (imx230->sync_mode != IMX230_SYNC_NONE) {
+		imx230->sync_locked = v4l2_ctrl_new_custom(&imx230->ctrls,
+						&imx230_sync_ctrls[0], NULL);
+		imx230->sync_error = v4l2_ctrl_new_custom(&imx230->ctrls,
+						&imx230_sync_ctrls[1], NULL);
+		v4l2_ctrl_cluster(2, &imx230->sync_locked);
+	}
+
 	imx230->sd.ctrl_handler = &imx230->ctrls;
 
 	if (imx230->ctrls.error) {
@@ -1841,11 +5557,15 @@ static int imx230_probe(struct i2c_client *client,
 
 	v4l2_i2c_subdev_init(&imx230->sd, client, &imx230_subdev_ops);
 	imx230->sd.flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
-	imx230->pad.flags = MEDIA_PAD_FL_SOURCE;
+	imx230->pads[IMX230_PAD_IMAGE].flags = MEDIA_PAD_FL_SOURCE;
+	imx230->pads[IMX230_PAD_META].flags = MEDIA_PAD_FL_SOURCE;
+	imx230->pads[IMX230_PAD_PDAF].flags = MEDIA_PAD_FL_SOURCE;
 	imx230->sd.dev = &client->dev;
 	imx230->sd.entity.function = MEDIA_ENT_F_CAM_SENSOR;
+	imx230->sd.entity.ops = &imx230_entity_ops;
 
-	ret = media_entity_pads_init(&imx230->sd.entity, 1, &imx230->pad);
+	ret = media_entity_pads_init(&imx230->sd.entity, IMX230_NUM_PADS,
+				     imx230->pads);
 	if (ret < 0) {
 		dev_err(dev, "could not register media entity\n");
 		goto free_ctrl;
@@ -1871,6 +5591,12 @@ static int imx230_probe(struct i2c_client *client,
 	}
 
 	dev_info(dev, "imx230 detected at address 0x%02x\n", client->addr);
+
+	ret = imx230_read_otp(imx230);
+	if (ret < 0)
+		dev_err(dev, "could not read otp\n");
+	else
+		imx230_register_otp(imx230);
 /*
 	ret = imx230_read_reg(imx230, imx230_AEC_PK_MANUAL,
 			      &imx230->aec_pk_manual);
@@ -1898,18 +5624,53 @@ static int imx230_probe(struct i2c_client *client,
 */
 	imx230_s_power(&imx230->sd, false);
 
+	if (imx230->trigger_gpio) {
+		ret = gpiod_to_irq(imx230->trigger_gpio);
+		if (ret >= 0) {
+			imx230->trigger_irq = ret;
+			/* Enabled while streaming, see imx230_s_stream() */
+			irq_set_status_flags(ret, IRQ_NOAUTOEN);
+			ret = devm_request_threaded_irq(dev, ret,
+					NULL, imx230_trigger_irq,
+					IRQF_TRIGGER_RISING | IRQF_ONESHOT,
+					"imx230-trigger", imx230);
+		}
+		if (ret < 0) {
+			dev_err(dev, "cannot request trigger irq\n");
+			imx230->trigger_gpio = NULL;
+			goto unregister_otp;
+		}
+	}
+
 	ret = v4l2_async_register_subdev(&imx230->sd);
 	if (ret < 0) {
 		dev_err(dev, "could not register v4l2 device\n");
-		goto free_entity;
+		goto unregister_otp;
 	}
 
 	imx230_entity_init_cfg(&imx230->sd, NULL);
 
+	init_completion(&imx230->lsc_done);
+	imx230_request_table(imx230, "sony,lsc-firmware", &imx230->lsc_done,
+			     imx230_lsc_loaded);
+	init_completion(&imx230->dpc_done);
+	imx230_request_table(imx230, "sony,dpc-firmware", &imx230->dpc_done,
+			     imx230_dpc_map_loaded);
+
+	imx230->hwmon = hwmon_device_register_with_info(dev, "imx230", imx230,
+						&imx230_hwmon_chip_info, NULL);
+	if (IS_ERR(imx230->hwmon)) {
+		dev_err(dev, "could not register hwmon device\n");
+		imx230->hwmon = NULL;
+	}
+
 	return 0;
 
 power_down:
 	imx230_s_power(&imx230->sd, false);
+unregister_otp:
+	if (imx230->otp_nvmem)
+		nvmem_unregister(imx230->otp_nvmem);
 free_entity:
 	media_entity_cleanup(&imx230->sd.entity);
 free_ctrl:
@@ -1925,6 +5686,19 @@ static int imx230_remove(struct i2c_client *client)
 	struct imx230 *imx230 = to_imx230(sd);
 
 	v4l2_async_unregister_subdev(&imx230->sd);
+	/* Still enabled if the stream was not stopped */
+	if (imx230->trigger_gpio && imx230->streaming)
+		disable_irq(imx230->trigger_irq);
+	cancel_delayed_work_sync(&imx230->trigger_work);
+	cancel_delayed_work_sync(&imx230->temp_work);
+	cancel_delayed_work_sync(&imx230->frame_work);
+	cancel_delayed_work_sync(&imx230->sync_work);
+	wait_for_completion(&imx230->lsc_done);
+	wait_for_completion(&imx230->dpc_done);
+	if (imx230->hwmon)
+		hwmon_device_unregister(imx230->hwmon);
+	if (imx230->otp_nvmem)
+		nvmem_unregister(imx230->otp_nvmem);
 	media_entity_cleanup(&imx230->sd.entity);
 	v4l2_ctrl_handler_free(&imx230->ctrls);
 	mutex_destroy(&imx230->power_lock);